@@ -1,241 +1,389 @@
-#pragma once
-
-#ifndef PERFORMANCE_STOPWATCH_H
-#define PERFORMANCE_STOPWATCH_H
-
-#include <iostream>
-
-/*******************************************************************************
- *  class Stopwatch -- simple stopwatch timer for performance optimization
- *
- *  Stopwatch prints out elapsed time information for measuring	the run time
- *  of long-running tasks. Stopwatch can also return the elapsed time without
- *  printing anything.
- *
- *  Stopwatch is meant to be used with the RAII idiom. In its
- *  simplest use, the block
- *      {
- *          Stopwatch sw("TheThing()");
- *          sw.Show("Just after initialized");
- *          TheThing();
- *      }
- *  produces two lines of output like
- *      TheThing(): start
- *      TheThing(): Just after initialized at 3mS
- *      // anything printed by TheThing()
- *      TheThing(): stop 63mS
- *
- *  If you prefer millisec then include logger/Stopwatchmsec.h in your code or 
- *  for microsec accuracy then include logger/Stopwatchmicro.h. Both uses chrono
- *  to measure time so if you find other ways to measure time, you can easily extend it.  
- *
- *  If you want Stopwatch print its measurements directly to Log,  then provide
- *  a nonempty activity while constructing. However if logging seem to take significant
- *  you can use "" empty activity so that you collect measurement values from return
- *  value and then log by yourself in the code all at once.
- *
- *  What StopWatch logs in detail:
- *      ctor():							"Stopwatch: start"
- *      ctor(false):					nothing printed
- *      Show():							"Stopwatch: show at xxxx mS"
- *                                      sets lap time. Get with LapGet()
- *      Stop():							"Stopwatch: stop xxxx mS"
- *                                      sets lap time. Get with LapGet()
- *      Stop() when not running:		"Stopwatch: not started"
- *      Start():						"Stopwatch: start"
- *                                      clears lap time
- *      Start() when running:			"Stopwatch: start xxxx mS"
- *                                      sets lap time. Get with LapGet()
- *  What it prints when activity name is specified
- *      ctor("activity"):				"activity: start"
- *      Show("theEvent"):				"activity: theEvent at xxxx mS"
- *      Stop("theEvent"):				"activity: theEvent xxxx mS"
- *                                      sets lap time. Get with LapGet()
- *      Stop("theEvent") not running:	"activity: not started"
- *      Start("theEvent") running:		"activity: theEvent xxxx mS"
- *                                      sets lap time. Get with LapGet()
- *      Start("theEvent") not running: "activity: theEvent"
- *                                      clears lap time
- *
- *  printing can be suppressed 
- *      ctor("") or ctor(nullptr)		prints nothing
- *      Show("") or Show(nullptr)		prints nothing, sets lap time
- *      Start("") or Start(nullptr):		prints nothing, sets lap time if running
- *      Stop("") or Stop(nullptr):		sets lap time. Get with LapGet()
- *
- ********************************************************************************/
-
-
-template <typename T> class basic_stopwatch : public T {
-public:
-    typedef T BaseTimer;
-    typedef unsigned long tick_t;
-
-    // create, optionally start timing an activity
-    explicit basic_stopwatch(bool start);
-    explicit basic_stopwatch(char const* activity = "Stopwatch",
-                             bool start=true);
-    basic_stopwatch(std::ostream& log,
-                    char const* activity="Stopwatch", 
-                    bool start=true); 
-
-    // stop and destroy a stopwatch
-    ~basic_stopwatch();
-
-    // get last lap time (time of last stop)
-    tick_t LapGet() const;
-
-    // predicate: return true if the stopwatch is running
-    bool IsStarted() const;
-
-    // show accumulated time, keep running, set/return lap
-    tick_t Show(char const* event="show");
-
-    // (re)start a stopwatch, set/return lap time
-    tick_t Start(char const* event_namee="start");
-
-    // stop a running stopwatch, set/return lap time
-    tick_t Stop(char const* event_name="stop");
-
-private:    //  members
-    char const*     m_activity; 	// "activity" string
-    tick_t          m_lap;		// lap time (time of last stop or 0)
-    std::ostream&   m_log;		// stream on which to log events
-};
-
-//  performs a Start() if start_now == true
-template <typename T> inline basic_stopwatch<T>::basic_stopwatch(bool start_now)
-  : m_activity("Stopwatch")
-  , m_lap(0)
-  , m_log(std::cout) 
-{
-    if (start_now)
-        Start();
-}
-
-//	performs a start if start_now == true, suppress print by ctor("")
-template <typename T> inline basic_stopwatch<T>::basic_stopwatch(char const* activity, bool start_now)
-  : m_activity(activity && activity[0] ? activity : nullptr)
-  , m_lap(0)
-  , m_log(std::cout) 
-{
-    if (start_now) {
-        if (m_activity)
-            Start();
-        else
-            Start(nullptr);
-    }
-}
-
-//	set log output, optional printout, optional start
-template <typename T> inline basic_stopwatch<T>::basic_stopwatch(std::ostream& log, char const* activity, bool start_now)
-  : m_activity(activity && activity[0] ? activity : nullptr)
-  , m_lap(0)
-  , m_log(log) 
-{
-    if (start_now) {
-        if (m_activity)
-            Start();
-        else
-            Start(nullptr);
-    }
-}
-
-//	stop/destroy stopwatch, print message if activity was set in ctor
-template <typename T> inline basic_stopwatch<T>::~basic_stopwatch() {
-    if (IsStarted()) {
-        if (m_activity)
-            Stop();
-        else
-            Stop(nullptr);
-    }
-}
-
-//   predicate: return true if the stopwatch is running
-template <typename T> inline bool basic_stopwatch<T>::IsStarted() const
-{
-    return BaseTimer::IsStarted();
-}
-
-//	get the last lap time (time of last stop)
-template <typename T> inline typename basic_stopwatch<T>::tick_t basic_stopwatch<T>::LapGet() const
-{
-    return m_lap;
-}
-
-//   show accumulated time, keep running, get/return lap time
-template <typename T> inline typename basic_stopwatch<T>::tick_t basic_stopwatch<T>::Show(char const* event_name) {
-    if (IsStarted()) {
-        m_lap = BaseTimer::GetMs();
-        if (event_name && event_name[0]) {
-            if (m_activity)
-                m_log << m_activity << ": " << event_name << " at " << m_lap << "mS" << std::endl << std::flush;
-        }
-    }
-    else {
-        if (m_activity)
-            m_log << m_activity << ": not started" << std::endl << std::flush;
-    }
-    return m_lap;
-}
-
-//   (re)start a stopwatch, set/return lap time
-template <typename T> inline typename basic_stopwatch<T>::tick_t basic_stopwatch<T>::Start(char const* event_name) {
-    if (IsStarted()) {
-        Stop(event_name);
-    }
-    else {
-        if (event_name && event_name[0]) {
-            if (m_activity)
-                m_log << m_activity << ": " << event_name << std::endl << std::flush;
-        }
-    }
-    BaseTimer::Start();
-    return m_lap;
-}
-
-//   stop a running stopwatch and print the accumulated time
-template <typename T> inline typename basic_stopwatch<T>::tick_t basic_stopwatch<T>::Stop(char const* event_name) {
-    if (IsStarted()) {
-        m_lap = BaseTimer::GetMs();
-        if (event_name && event_name[0]) {
-            if (m_activity)
-                m_log << m_activity << ": " << event_name << " " << m_lap << "mS" << std::endl << std::flush;
-        }
-    }
-    BaseTimer::Clear();
-    return m_lap;
-}
-
-template <typename clock_, typename resolution>
-class TimerBaseChrono {
-
-public:
-        //      clears the timer
-        TimerBaseChrono() : m_start(clock_::time_point::min()) { }
-
-        //  clears the timer
-        void Clear() { 
-                m_start = clock_::time_point::min(); 
-        }
-
-        //      returns true if the timer is running
-        bool IsStarted() const {
-                return (m_start != clock_::time_point::min());
-        }
-
-        //      start the timer
-        void Start()            { m_start = clock_::now(); }
-
-        //      get the period since the timer was started
-        unsigned long GetMs() {
-                if (IsStarted()) {
-                        return (unsigned long)(std::chrono::duration_cast<resolution>(clock_::now() - m_start).count());
-                }
-                return 0;
-        }
-private:
-        std::chrono::system_clock::time_point m_start;
-};
-
-# endif
+#pragma once
+
+#ifndef PERFORMANCE_STOPWATCH_H
+#define PERFORMANCE_STOPWATCH_H
+
+#include <chrono>
+#include <iostream>
+#include "stopwatchformat.h"
+#include "stopwatchsite.h"
+#include "stopwatchusdt.h"
+
+/*******************************************************************************
+ *  class Stopwatch -- simple stopwatch timer for performance optimization
+ *
+ *  Stopwatch prints out elapsed time information for measuring	the run time
+ *  of long-running tasks. Stopwatch can also return the elapsed time without
+ *  printing anything.
+ *
+ *  Stopwatch is meant to be used with the RAII idiom. In its
+ *  simplest use, the block
+ *      {
+ *          Stopwatch sw("TheThing()");
+ *          sw.Show("Just after initialized");
+ *          TheThing();
+ *      }
+ *  produces two lines of output like
+ *      TheThing(): start
+ *      TheThing(): Just after initialized at 3ms
+ *      // anything printed by TheThing()
+ *      TheThing(): stop 63ms
+ *
+ *  If you prefer millisec then include logger/Stopwatchmsec.h in your code or 
+ *  for microsec accuracy then include logger/Stopwatchmicro.h. Both uses chrono
+ *  to measure time so if you find other ways to measure time, you can easily extend it.  
+ *
+ *  Laps are counted in the resolution of the timer, basic_stopwatch::duration,
+ *  and printed with its unit: "ms" for Stopwatch, "us" for Stopwatchmicro.
+ *  Older versions printed "mS" for every timer, microsecond ones included;
+ *  the unit changed on purpose, update anything that parses the old lines.
+ *  The duration is the timer base's T::duration; a base without one is
+ *  taken to count milliseconds, as GetMs() says.
+ *  LapDuration() returns the lap as a std::chrono duration. The
+ *  stopwatch_format_text_scaled formatter picks ns/us/ms/s by magnitude and
+ *  prints two decimals, e.g. "stop 1.27s".
+ *
+ *  If you want Stopwatch print its measurements directly to Log,  then provide
+ *  a nonempty activity while constructing. However if logging seem to take significant
+ *  you can use "" empty activity so that you collect measurement values from return
+ *  value and then log by yourself in the code all at once.
+ *
+ *  What StopWatch logs in detail:
+ *      ctor():							"Stopwatch: start"
+ *      ctor(false):					nothing printed
+ *      Show():							"Stopwatch: show at xxxx ms"
+ *                                      sets lap time. Get with LapGet()
+ *      Stop():							"Stopwatch: stop xxxx ms"
+ *                                      sets lap time. Get with LapGet()
+ *      Stop() when not running:		"Stopwatch: not started"
+ *      Start():						"Stopwatch: start"
+ *                                      clears lap time
+ *      Start() when running:			"Stopwatch: start xxxx ms"
+ *                                      sets lap time. Get with LapGet()
+ *  What it prints when activity name is specified
+ *      ctor("activity"):				"activity: start"
+ *      Show("theEvent"):				"activity: theEvent at xxxx ms"
+ *      Stop("theEvent"):				"activity: theEvent xxxx ms"
+ *                                      sets lap time. Get with LapGet()
+ *      Stop("theEvent") not running:	"activity: not started"
+ *      Start("theEvent") running:		"activity: theEvent xxxx ms"
+ *                                      sets lap time. Get with LapGet()
+ *      Start("theEvent") not running: "activity: theEvent"
+ *                                      clears lap time
+ *
+ *  printing can be suppressed 
+ *      ctor("") or ctor(nullptr)		prints nothing
+ *      Show("") or Show(nullptr)		prints nothing, sets lap time
+ *      Start("") or Start(nullptr):		prints nothing, sets lap time if running
+ *      Stop("") or Stop(nullptr):		sets lap time. Get with LapGet()
+ *
+ *  Constructed from a call site, ctor(STOPWATCH_SITE("activity")), the
+ *  stopwatch can be switched off at runtime through stopwatch_registry; a
+ *  disabled stopwatch reads no clock and prints nothing. The registry, its
+ *  control file thread and the overhead governor are opt-in: include
+ *  stopwatchregistry.h (or stopwatchgovernor.h) for STOPWATCH_SITE(), this
+ *  header only needs stopwatch_site from stopwatchsite.h. The registry can
+ *  also gauge how many stopwatches of a site run at once, see
+ *  stopwatchgauge.h.
+ *
+ *  Start(), Show() and Stop() also fire the USDT probes stopwatch:start,
+ *  stopwatch:show and stopwatch:stop for bpftrace and friends, see
+ *  stopwatchusdt.h.
+ *
+ *  The lines above come from the default formatter, stopwatch_format_text.
+ *  Pass another formatter as the second template parameter for CSV, JSON
+ *  lines or logfmt output, see stopwatchformat.h.
+ *
+ ********************************************************************************/
+
+
+//  the timer base's raw clock reading at Start(), 0 for bases without
+//  GetStartTicks()
+template <typename T> inline auto stopwatch_start_ticks(T const& t, int) -> decltype(t.GetStartTicks()) {
+    return t.GetStartTicks();
+}
+
+template <typename T> inline long long stopwatch_start_ticks(T const&, long) {
+    return 0;
+}
+
+//  the lap unit of a timer base: its duration typedef, or milliseconds for
+//  bases that only have GetMs()
+template <typename> struct stopwatch_void { typedef void type; };
+
+template <typename T, typename = void> struct stopwatch_duration {
+    typedef std::chrono::milliseconds type;
+};
+
+template <typename T> struct stopwatch_duration<T, typename stopwatch_void<typename T::duration>::type> {
+    typedef typename T::duration type;
+};
+
+template <typename T, typename F = stopwatch_format_text> class basic_stopwatch : public T {
+public:
+    typedef T BaseTimer;
+    typedef F Formatter;
+    typedef typename stopwatch_duration<T>::type duration;     // unit of lap times
+    typedef unsigned long tick_t;
+
+    // create, optionally start timing an activity
+    explicit basic_stopwatch(bool start);
+    explicit basic_stopwatch(char const* activity = "Stopwatch",
+                             bool start=true);
+    basic_stopwatch(std::ostream& log,
+                    char const* activity="Stopwatch", 
+                    bool start=true); 
+
+    // create for a registered call site, does nothing if the site is disabled
+    explicit basic_stopwatch(stopwatch_site& site, bool start=true);
+    basic_stopwatch(std::ostream& log, stopwatch_site& site, bool start=true);
+
+    // stop and destroy a stopwatch
+    ~basic_stopwatch();
+
+    // get last lap time (time of last stop)
+    tick_t LapGet() const;
+
+    // get last lap time as a duration
+    duration LapDuration() const { return duration(m_lap); }
+
+    // suffix of the lap unit, e.g. "us"
+    static char const* Unit() { return stopwatch_unit<duration>::suffix(); }
+
+    // predicate: return true if the stopwatch is running
+    bool IsStarted() const;
+
+    // show accumulated time, keep running, set/return lap
+    tick_t Show(char const* event="show");
+
+    // (re)start a stopwatch, set/return lap time
+    tick_t Start(char const* event_namee="start");
+
+    // stop a running stopwatch, set/return lap time
+    tick_t Stop(char const* event_name="stop");
+
+private:
+    long long StartTicks() const { return stopwatch_start_ticks(static_cast<BaseTimer const&>(*this), 0); }
+
+    //  members
+    char const*     m_activity; 	// "activity" string
+    tick_t          m_lap;		// lap time (time of last stop or 0)
+    std::ostream&   m_log;		// stream on which to log events
+    bool            m_enabled;	// false if constructed from a disabled site
+    stopwatch_site* m_site;		// site to charge bookkeeping cost to, or null
+    stopwatch_gauge* m_gauge;		// gauge of the site, or null
+    long long       m_gauge_start;	// gauge time at Start()
+};
+
+//  performs a Start() if start_now == true
+template <typename T, typename F> inline basic_stopwatch<T, F>::basic_stopwatch(bool start_now)
+  : m_activity("Stopwatch")
+  , m_lap(0)
+  , m_log(std::cout) 
+  , m_enabled(true)
+  , m_site(nullptr)
+  , m_gauge(nullptr)
+  , m_gauge_start(0)
+{
+    if (start_now)
+        Start();
+}
+
+//	performs a start if start_now == true, suppress print by ctor("")
+template <typename T, typename F> inline basic_stopwatch<T, F>::basic_stopwatch(char const* activity, bool start_now)
+  : m_activity(activity && activity[0] ? activity : nullptr)
+  , m_lap(0)
+  , m_log(std::cout) 
+  , m_enabled(true)
+  , m_site(nullptr)
+  , m_gauge(nullptr)
+  , m_gauge_start(0)
+{
+    if (start_now) {
+        if (m_activity)
+            Start();
+        else
+            Start(nullptr);
+    }
+}
+
+//	set log output, optional printout, optional start
+template <typename T, typename F> inline basic_stopwatch<T, F>::basic_stopwatch(std::ostream& log, char const* activity, bool start_now)
+  : m_activity(activity && activity[0] ? activity : nullptr)
+  , m_lap(0)
+  , m_log(log) 
+  , m_enabled(true)
+  , m_site(nullptr)
+  , m_gauge(nullptr)
+  , m_gauge_start(0)
+{
+    if (start_now) {
+        if (m_activity)
+            Start();
+        else
+            Start(nullptr);
+    }
+}
+
+//	start only if the call site is enabled and samples this stopwatch, a
+//	skipped one stays silent
+template <typename T, typename F> inline basic_stopwatch<T, F>::basic_stopwatch(stopwatch_site& site, bool start_now)
+  : m_activity(nullptr)
+  , m_lap(0)
+  , m_log(std::cout) 
+  , m_enabled(false)
+  , m_site(nullptr)
+  , m_gauge(nullptr)
+  , m_gauge_start(0)
+{
+    int admit = site.Admit();
+    m_enabled = admit != 0;
+    if (admit == 2)
+        m_site = &site;
+    if (m_enabled) {
+        m_gauge = site.gauge.load(std::memory_order_acquire);
+        m_activity = site.activity && site.activity[0] ? site.activity : nullptr;
+        if (start_now)
+            Start(m_activity ? "start" : nullptr);
+    }
+}
+
+template <typename T, typename F> inline basic_stopwatch<T, F>::basic_stopwatch(std::ostream& log, stopwatch_site& site, bool start_now)
+  : m_activity(nullptr)
+  , m_lap(0)
+  , m_log(log) 
+  , m_enabled(false)
+  , m_site(nullptr)
+  , m_gauge(nullptr)
+  , m_gauge_start(0)
+{
+    int admit = site.Admit();
+    m_enabled = admit != 0;
+    if (admit == 2)
+        m_site = &site;
+    if (m_enabled) {
+        m_gauge = site.gauge.load(std::memory_order_acquire);
+        m_activity = site.activity && site.activity[0] ? site.activity : nullptr;
+        if (start_now)
+            Start(m_activity ? "start" : nullptr);
+    }
+}
+
+//	stop/destroy stopwatch, print message if activity was set in ctor
+template <typename T, typename F> inline basic_stopwatch<T, F>::~basic_stopwatch() {
+    if (IsStarted()) {
+        if (m_activity)
+            Stop();
+        else
+            Stop(nullptr);
+    }
+}
+
+//   predicate: return true if the stopwatch is running
+template <typename T, typename F> inline bool basic_stopwatch<T, F>::IsStarted() const
+{
+    return BaseTimer::IsStarted();
+}
+
+//	get the last lap time (time of last stop)
+template <typename T, typename F> inline typename basic_stopwatch<T, F>::tick_t basic_stopwatch<T, F>::LapGet() const
+{
+    return m_lap;
+}
+
+//   show accumulated time, keep running, get/return lap time
+template <typename T, typename F> inline typename basic_stopwatch<T, F>::tick_t basic_stopwatch<T, F>::Show(char const* event_name) {
+    if (IsStarted()) {
+        stopwatch_cost_guard cost(m_site);
+        m_lap = BaseTimer::GetMs();
+        STOPWATCH_USDT3(show, m_activity ? m_activity : "", event_name ? event_name : "", m_lap);
+        if (event_name && event_name[0]) {
+            if (m_activity)
+                Formatter::template Write<duration>(m_log, m_activity, event_name, stopwatch_event_show, m_lap, StartTicks());
+        }
+    }
+    else {
+        if (m_activity)
+            Formatter::template Write<duration>(m_log, m_activity, "", stopwatch_event_not_started, m_lap, 0);
+    }
+    return m_lap;
+}
+
+//   (re)start a stopwatch, set/return lap time
+template <typename T, typename F> inline typename basic_stopwatch<T, F>::tick_t basic_stopwatch<T, F>::Start(char const* event_name) {
+    if (!m_enabled)
+        return m_lap;
+    bool restart = IsStarted();
+    if (restart)
+        Stop(event_name);
+    //  printing, probe, gauge and the clock read of the start
+    stopwatch_cost_guard cost(m_site);
+    if (!restart && event_name && event_name[0]) {
+        if (m_activity)
+            Formatter::template Write<duration>(m_log, m_activity, event_name, stopwatch_event_start, m_lap, 0);
+    }
+    STOPWATCH_USDT2(start, m_activity ? m_activity : "", event_name ? event_name : "");
+    if (m_gauge)
+        m_gauge_start = m_gauge->Enter();
+    BaseTimer::Start();
+    return m_lap;
+}
+
+//   stop a running stopwatch and print the accumulated time
+template <typename T, typename F> inline typename basic_stopwatch<T, F>::tick_t basic_stopwatch<T, F>::Stop(char const* event_name) {
+    if (IsStarted()) {
+        //  the clock read of the lap, probe, gauge and printing
+        stopwatch_cost_guard cost(m_site);
+        m_lap = BaseTimer::GetMs();
+        STOPWATCH_USDT3(stop, m_activity ? m_activity : "", event_name ? event_name : "", m_lap);
+        if (m_gauge)
+            m_gauge->Exit(m_gauge_start);
+        if (event_name && event_name[0]) {
+            if (m_activity)
+                Formatter::template Write<duration>(m_log, m_activity, event_name, stopwatch_event_stop, m_lap, StartTicks());
+        }
+    }
+    BaseTimer::Clear();
+    return m_lap;
+}
+
+template <typename clock_, typename resolution>
+class TimerBaseChrono {
+
+public:
+        typedef resolution duration;    // unit of GetMs()
+        typedef clock_ clock;           // clock of GetStartTicks()
+
+        //      clears the timer
+        TimerBaseChrono() : m_start(clock_::time_point::min()) { }
+
+        //  clears the timer
+        void Clear() { 
+                m_start = clock_::time_point::min(); 
+        }
+
+        //      returns true if the timer is running
+        bool IsStarted() const {
+                return (m_start != clock_::time_point::min());
+        }
+
+        //      start the timer
+        void Start()            { m_start = clock_::now(); }
+
+        //      raw clock reading at Start(), 0 if not running
+        long long GetStartTicks() const {
+                return IsStarted() ? (long long)m_start.time_since_epoch().count() : 0;
+        }
+
+        //      get the period since the timer was started
+        unsigned long GetMs() {
+                if (IsStarted()) {
+                        return (unsigned long)(std::chrono::duration_cast<resolution>(clock_::now() - m_start).count());
+                }
+                return 0;
+        }
+private:
+        typename clock_::time_point m_start;
+};
+
+# endif
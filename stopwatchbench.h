@@ -0,0 +1,934 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_BENCH_H
+#define PERF_STOPWATCH_BENCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#include "stopwatch.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+/*******************************************************************************
+ *  class basic_bench -- micro benchmark runner on top of basic_stopwatch
+ *
+ *  Each registered body is run in samples of N iterations, N chosen so a
+ *  sample takes at least MinSampleSet() time units. The result of a
+ *  benchmark is the list of per-iteration times of its samples.
+ *
+ *      int main(int argc, char** argv) {
+ *          Benchmark bench;
+ *          bench.Add("vector push_back", [] { v.push_back(1); });
+ *          return bench.Main(argc, argv);
+ *      }
+ *
+ *  Families run one body over a range of sizes, and over a list of types.
+ *  Sizes go from lo to hi, multiplied by mult each step (hi always included).
+ *  Every size is reported with its throughput, and after the run the median
+ *  times of the family are fitted to O(1), O(log n), O(n), O(n log n),
+ *  O(n^2) and O(n^3), reporting the model with the lowest relative RMS.
+ *
+ *      bench.AddRange("sort", 1, 1 << 20, [](size_t n) { ... });
+ *
+ *      template <typename C> struct Fill {
+ *          explicit Fill(size_t n) : n(n) { }      // set up once per size
+ *          void operator()() { C c; for (size_t i = 0; i < n; ++i) c.insert(c.end(), i); }
+ *          size_t n;
+ *      };
+ *      bench.AddTyped<Fill, std::vector<int>, std::list<int> >("fill", 1, 1 << 20);
+ *
+ *  Type names come from bench_type_name<T>, specialize it for readable names.
+ *
+ *  Threaded benchmarks run body(thread index) on 1, 2, 4 ... N threads that
+ *  are released together from a start barrier. Each thread count is one
+ *  result "name/threads:k" whose samples are wall time per operation over all
+ *  threads. Each line also shows aggregate throughput, the per-thread time per
+ *  operation (p50/p99/max over threads and samples) and scaling efficiency,
+ *  throughput(k) / (k * throughput(1)).
+ *
+ *      bench.AddThreaded("queue push/pop", [&](unsigned) { q.push(1); q.pop(); });
+ *
+ *  Main() understands
+ *      --save-baseline FILE    write the results as a JSON baseline
+ *      --compare FILE          compare against a baseline, exit 1 if any
+ *                              benchmark got significantly slower
+ *      --samples N             samples per benchmark (default 30)
+ *      --alpha P               significance level (default 0.01)
+ *      --threshold F           smallest relative slowdown that counts as a
+ *                              regression (default 0.02)
+ *      --cpu N                 pin to core N, -1 picks an isolated core
+ *                              (isolcpus=) or the last allowed one
+ *      --fifo                  run under SCHED_FIFO if permitted, pins to a
+ *                              core like --cpu -1 unless --cpu is given
+ *      --keep-noisy            keep samples disturbed by context switches
+ *
+ *  Noise control (Linux): the runner can pin itself to one core and switch to
+ *  SCHED_FIFO for the duration of Run(). Every sample reads the thread's
+ *  context switch counts (getrusage(RUSAGE_THREAD)) before and after; a
+ *  sample during which the thread was switched out is discarded and retaken.
+ *  The scaling governor and turbo state of the core are recorded with the
+ *  results and in the baseline, with a warning when they add noise.
+ *
+ *  Comparison uses the two-sided Mann-Whitney U test on the samples, so it
+ *  doesn't assume normally distributed timings. A benchmark is a regression
+ *  when p < alpha and its median is more than threshold above the baseline.
+ *
+ *  What it prints
+ *      Run():                          "bench: cpu 3 SCHED_FIFO governor performance turbo off"
+ *                                      "name: 123ns (median of 30 x 4096, 2 discarded)"
+ *                                      "family/1024: 5.1us (median of 30 x 128) 200M items/s"
+ *                                      "family: O(n log n) 0.52ns rms 3.1%"
+ *                                      "name/threads:4: 12ns (median of 30 x 4096) 83M ops/s
+ *                                       per-thread p50 47ns p99 52ns max 60ns efficiency 91%"
+ *      CompareBaseline():              "name: 123ns -> 130ns +5.7% p=0.0001 REGRESSION"
+ *                                      "name: not in baseline"
+ *
+ ********************************************************************************/
+
+struct bench_result {
+    std::string         name;
+    unsigned long       iterations;     // iterations per sample
+    std::vector<double> samples;        // time per iteration, one per sample
+    unsigned            discarded;      // samples dropped for context switches
+    std::string         family;         // family name, "" for single benchmarks
+    unsigned long long  arg;            // size within the family
+    unsigned            threads;        // thread count, 0 for single threaded
+    std::vector<double> thread_samples; // per-thread time per iteration
+
+    bench_result() : iterations(0), discarded(0), arg(0), threads(0) { }
+
+    double Median() const {
+        if (samples.empty())
+            return 0.0;
+        std::vector<double> s(samples);
+        std::sort(s.begin(), s.end());
+        size_t n = s.size();
+        return n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2.0;
+    }
+};
+
+//  the conditions a benchmark ran under
+struct bench_env {
+    int         cpu;            // core the runner is pinned to, -1 if not pinned
+    bool        fifo;           // running under SCHED_FIFO
+    std::string governor;       // cpufreq scaling governor, "" if unknown
+    std::string turbo;          // "on", "off" or "" if unknown
+
+    bench_env() : cpu(-1), fifo(false) { }
+
+    // first line of a sysfs file, "" if it can't be read
+    static std::string ReadLine(std::string const& path) {
+        std::ifstream is(path.c_str());
+        std::string line;
+        std::getline(is, line);
+        return line;
+    }
+
+    // read governor and turbo state of cpu
+    void Probe(int core) {
+        std::ostringstream path;
+        path << "/sys/devices/system/cpu/cpu" << (core < 0 ? 0 : core) << "/cpufreq/scaling_governor";
+        governor = ReadLine(path.str());
+        std::string no_turbo = ReadLine("/sys/devices/system/cpu/intel_pstate/no_turbo");
+        std::string boost = ReadLine("/sys/devices/system/cpu/cpufreq/boost");
+        if (!no_turbo.empty())
+            turbo = no_turbo == "1" ? "off" : "on";
+        else if (!boost.empty())
+            turbo = boost == "1" ? "on" : "off";
+        else
+            turbo.clear();
+    }
+
+    // an isolated core the process may run on, else the last allowed core, -1 if unknown
+    static int PickCore() {
+#if defined(__linux__)
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return -1;
+        std::string isolated = ReadLine("/sys/devices/system/cpu/isolated");
+        for (size_t p = 0; p < isolated.size(); ) {
+            char* end;
+            long lo = std::strtol(isolated.c_str() + p, &end, 10);
+            long hi = *end == '-' ? std::strtol(end + 1, &end, 10) : lo;
+            for (long c = lo; c <= hi && c < CPU_SETSIZE; ++c) {
+                if (c >= 0 && CPU_ISSET(c, &allowed))
+                    return (int)c;
+            }
+            p = (size_t)(end - isolated.c_str());
+            if (p < isolated.size() && isolated[p] == ',')
+                ++p;
+            else
+                break;
+        }
+        for (int c = CPU_SETSIZE - 1; c >= 0; --c) {
+            if (CPU_ISSET(c, &allowed))
+                return c;
+        }
+#endif
+        return -1;
+    }
+
+    // context switches of the calling thread so far
+    static long ContextSwitches() {
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+        struct rusage ru;
+        if (getrusage(RUSAGE_THREAD, &ru) == 0)
+            return ru.ru_nvcsw + ru.ru_nivcsw;
+#endif
+        return 0;
+    }
+};
+
+//  printable type names for AddTyped(), specialize for your own types
+template <typename T> struct bench_type_name {
+    static std::string get() { return typeid(T).name(); }
+};
+
+#define PERF_STOPWATCH_BENCH_TYPE_NAME(type) \
+    template <> struct bench_type_name<type> { static std::string get() { return #type; } };
+PERF_STOPWATCH_BENCH_TYPE_NAME(char)
+PERF_STOPWATCH_BENCH_TYPE_NAME(short)
+PERF_STOPWATCH_BENCH_TYPE_NAME(int)
+PERF_STOPWATCH_BENCH_TYPE_NAME(long)
+PERF_STOPWATCH_BENCH_TYPE_NAME(long long)
+PERF_STOPWATCH_BENCH_TYPE_NAME(unsigned)
+PERF_STOPWATCH_BENCH_TYPE_NAME(unsigned long)
+PERF_STOPWATCH_BENCH_TYPE_NAME(unsigned long long)
+PERF_STOPWATCH_BENCH_TYPE_NAME(float)
+PERF_STOPWATCH_BENCH_TYPE_NAME(double)
+PERF_STOPWATCH_BENCH_TYPE_NAME(std::string)
+
+//  least squares fit of times t(n) to c * f(n) for the usual complexity
+//  classes, returns the name of the best fit and sets coef and rms (relative)
+inline char const* bench_complexity(std::vector<std::pair<double, double> > const& points, double& coef, double& rms) {
+    static char const* const names[] = { "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)", "O(n^3)" };
+    char const* best = "O(?)";
+    coef = 0.0;
+    rms = 0.0;
+    if (points.empty())
+        return best;
+
+    double mean = 0.0;
+    for (size_t i = 0; i < points.size(); ++i)
+        mean += points[i].second;
+    mean /= (double)points.size();
+    if (mean <= 0.0)
+        return best;
+
+    double best_rms = -1.0;
+    for (int m = 0; m < 6; ++m) {
+        double ff = 0.0, tf = 0.0;
+        std::vector<double> f(points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            double n = points[i].first;
+            double lg = n > 1.0 ? std::log2(n) : 1.0;
+            f[i] = m == 0 ? 1.0 : m == 1 ? lg : m == 2 ? n : m == 3 ? n * lg : m == 4 ? n * n : n * n * n;
+            ff += f[i] * f[i];
+            tf += points[i].second * f[i];
+        }
+        double c = tf / ff;
+        double err = 0.0;
+        for (size_t i = 0; i < points.size(); ++i) {
+            double d = points[i].second - c * f[i];
+            err += d * d;
+        }
+        err = std::sqrt(err / (double)points.size()) / mean;
+        if (best_rms < 0.0 || err < best_rms) {
+            best_rms = err;
+            best = names[m];
+            coef = c;
+        }
+    }
+    rms = best_rms;
+    return best;
+}
+
+//  two-sided Mann-Whitney U test, returns the p value (normal approximation
+//  with tie correction)
+inline double bench_mann_whitney(std::vector<double> const& a, std::vector<double> const& b) {
+    size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if (n1 == 0 || n2 == 0)
+        return 1.0;
+
+    std::vector<std::pair<double, int> > all;
+    all.reserve(n);
+    for (size_t i = 0; i < n1; ++i)
+        all.push_back(std::make_pair(a[i], 0));
+    for (size_t i = 0; i < n2; ++i)
+        all.push_back(std::make_pair(b[i], 1));
+    std::sort(all.begin(), all.end());
+
+    double rank_a = 0.0, ties = 0.0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && all[j].first == all[i].first)
+            ++j;
+        double rank = (double)(i + j + 1) / 2.0;    // average of ranks i+1..j
+        for (size_t k = i; k < j; ++k) {
+            if (all[k].second == 0)
+                rank_a += rank;
+        }
+        double t = (double)(j - i);
+        ties += t * t * t - t;
+        i = j;
+    }
+
+    double u = rank_a - (double)n1 * (double)(n1 + 1) / 2.0;
+    double mean = (double)n1 * (double)n2 / 2.0;
+    double var = (double)n1 * (double)n2 / 12.0 * ((double)(n + 1) - ties / ((double)n * (double)(n - 1)));
+    if (var <= 0.0)
+        return 1.0;
+    double diff = std::fabs(u - mean) - 0.5;
+    double z = (diff > 0.0 ? diff : 0.0) / std::sqrt(var);
+    return std::erfc(z / std::sqrt(2.0));
+}
+
+template <typename T> class basic_bench {
+public:
+    typedef basic_stopwatch<T> stopwatch_t;
+
+    explicit basic_bench(std::ostream& log = std::cout);
+
+    // register a benchmark body, run once per iteration
+    void Add(std::string const& name, std::function<void()> const& body);
+
+    // register body(n) for n = lo, lo*mult, ... hi, as "name/n"
+    void AddRange(std::string const& name, size_t lo, size_t hi,
+                  std::function<void(size_t)> const& body, size_t mult = 2);
+
+    // register F<T>(n)() for every type T and every n in the range, as
+    // "name<T>/n". F<T> is constructed once per size, before timing
+    template <template <typename> class F, typename... Types>
+    void AddTyped(std::string const& name, size_t lo, size_t hi, size_t mult = 2);
+
+    // register body(thread index) to run on 1, 2, 4 ... max_threads threads
+    // at once, 0 means std::thread::hardware_concurrency()
+    void AddThreaded(std::string const& name, std::function<void(unsigned)> const& body,
+                     unsigned max_threads = 0);
+
+    // samples per benchmark, shortest time of one sample in timer units
+    void SamplesSet(unsigned samples)           { m_samples = samples ? samples : 1; }
+    void MinSampleSet(unsigned long min_sample) { m_min_sample = min_sample; }
+
+    // pin Run() to a core (-1 picks one), optionally under SCHED_FIFO
+    void PinSet(int cpu, bool fifo = false)     { m_pin = true; m_cpu = cpu; m_fifo = fifo; }
+
+    // keep or discard samples disturbed by context switches (default discard)
+    void KeepNoisySet(bool keep)                { m_keep_noisy = keep; }
+
+    // conditions of the last Run()
+    bench_env const& Env() const                { return m_env; }
+
+    // run all benchmarks, print one line each
+    void Run();
+
+    // results of the last Run()
+    std::vector<bench_result> const& Results() const { return m_results; }
+
+    // write the results as a JSON baseline
+    bool SaveBaseline(std::string const& path) const;
+
+    // read a JSON baseline written by SaveBaseline()
+    static bool LoadBaseline(std::string const& path, std::vector<bench_result>& out);
+
+    // compare the results with a baseline, return the number of regressions
+    int CompareBaseline(std::vector<bench_result> const& baseline,
+                        double alpha = 0.01, double threshold = 0.02) const;
+
+    // parse options, run, save/compare; returns the process exit code
+    int Main(int argc, char** argv);
+
+protected:
+    // suffix of the timer's resolution
+    static char const* unit() {
+        return stopwatch_unit<typename T::duration>::suffix();
+    }
+
+    // seconds per timer unit
+    static double unit_seconds() {
+        typedef typename T::duration::period period;
+        return (double)period::num / (double)period::den;
+    }
+
+    struct entry {
+        std::string             name;
+        std::function<void()>   body;
+        std::function<std::function<void()>()> setup;  // makes body if set
+        std::string             family;
+        unsigned long long      arg;
+        std::function<void(unsigned)> threaded;         // body of threaded benchmarks
+        unsigned                max_threads;
+    };
+
+    // time one threaded benchmark at thread count k
+    bench_result MeasureThreaded(entry const& e, unsigned k, unsigned long iterations);
+
+    // print the result line of one benchmark
+    void Report(bench_result const& r, bench_result const* single);
+
+    static std::vector<size_t> Sizes(size_t lo, size_t hi, size_t mult);
+
+    template <template <typename> class F>
+    void AddTypes(std::string const&, size_t, size_t, size_t) { }
+    template <template <typename> class F, typename Type, typename... Rest>
+    void AddTypes(std::string const& name, size_t lo, size_t hi, size_t mult);
+
+    // fit the families of the last Run() and print the complexities
+    void ReportComplexity();
+
+    // iterations per sample: doubled until one sample is long enough
+    unsigned long Calibrate(std::function<void()> const& body);
+
+    // time one benchmark into result
+    bench_result Measure(entry const& e);
+
+    // apply pinning and scheduling for Run(), and undo it
+    void EnvEnter();
+    void EnvLeave();
+
+    // switch the runner between SCHED_FIFO and its saved policy, if Run() got FIFO
+    void RunnerFifo(bool on);
+
+    std::vector<entry>          m_entries;
+    std::vector<bench_result>   m_results;
+    unsigned                    m_samples;
+    unsigned long               m_min_sample;
+    bool                        m_pin;
+    int                         m_cpu;
+    bool                        m_fifo;
+    bool                        m_keep_noisy;
+    bench_env                   m_env;
+#if defined(__linux__)
+    cpu_set_t                   m_saved_affinity;
+    int                         m_saved_policy;
+    struct sched_param          m_saved_param;
+#endif
+    std::ostream&               m_log;      // stream on which to print results
+};
+
+template <typename T> inline basic_bench<T>::basic_bench(std::ostream& log)
+  : m_samples(30)
+  , m_min_sample(1000000)
+  , m_pin(false)
+  , m_cpu(-1)
+  , m_fifo(false)
+  , m_keep_noisy(false)
+  , m_log(log)
+{
+}
+
+template <typename T> inline void basic_bench<T>::Add(std::string const& name, std::function<void()> const& body) {
+    entry e;
+    e.name = name;
+    e.body = body;
+    e.arg = 0;
+    e.max_threads = 0;
+    m_entries.push_back(e);
+}
+
+template <typename T> inline void basic_bench<T>::AddThreaded(std::string const& name, std::function<void(unsigned)> const& body, unsigned max_threads) {
+    entry e;
+    e.name = name;
+    e.threaded = body;
+    e.arg = 0;
+    e.max_threads = max_threads ? max_threads : std::thread::hardware_concurrency();
+    if (e.max_threads == 0)
+        e.max_threads = 1;
+    m_entries.push_back(e);
+}
+
+template <typename T> inline std::vector<size_t> basic_bench<T>::Sizes(size_t lo, size_t hi, size_t mult) {
+    std::vector<size_t> sizes;
+    if (mult < 2)
+        mult = 2;
+    for (size_t n = lo ? lo : 1; n < hi; n *= mult) {
+        sizes.push_back(n);
+        if (n > hi / mult)
+            break;
+    }
+    sizes.push_back(hi);
+    return sizes;
+}
+
+template <typename T> inline void basic_bench<T>::AddRange(std::string const& name, size_t lo, size_t hi, std::function<void(size_t)> const& body, size_t mult) {
+    std::vector<size_t> sizes = Sizes(lo, hi, mult);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        size_t n = sizes[i];
+        std::ostringstream full;
+        full << name << "/" << n;
+        entry e;
+        e.name = full.str();
+        e.body = [body, n]() { body(n); };
+        e.family = name;
+        e.arg = n;
+        e.max_threads = 0;
+        m_entries.push_back(e);
+    }
+}
+
+template <typename T> template <template <typename> class F, typename... Types>
+inline void basic_bench<T>::AddTyped(std::string const& name, size_t lo, size_t hi, size_t mult) {
+    AddTypes<F, Types...>(name, lo, hi, mult);
+}
+
+template <typename T> template <template <typename> class F, typename Type, typename... Rest>
+inline void basic_bench<T>::AddTypes(std::string const& name, size_t lo, size_t hi, size_t mult) {
+    std::string family = name + "<" + bench_type_name<Type>::get() + ">";
+    std::vector<size_t> sizes = Sizes(lo, hi, mult);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        size_t n = sizes[i];
+        std::ostringstream full;
+        full << family << "/" << n;
+        entry e;
+        e.name = full.str();
+        e.setup = [n]() -> std::function<void()> {
+            std::shared_ptr< F<Type> > f = std::make_shared< F<Type> >(n);
+            return [f]() { (*f)(); };
+        };
+        e.family = family;
+        e.arg = n;
+        e.max_threads = 0;
+        m_entries.push_back(e);
+    }
+    AddTypes<F, Rest...>(name, lo, hi, mult);
+}
+
+template <typename T> inline unsigned long basic_bench<T>::Calibrate(std::function<void()> const& body) {
+    stopwatch_t sw("", false);
+    unsigned long iterations = 1;
+    for (;;) {
+        sw.Start(nullptr);
+        for (unsigned long i = 0; i < iterations; ++i)
+            body();
+        if (sw.Stop(nullptr) >= m_min_sample || iterations >= (1ul << 30))
+            return iterations;
+        iterations *= 2;
+    }
+}
+
+//  calibrate the iteration count, then sample
+template <typename T> inline bench_result basic_bench<T>::Measure(entry const& e) {
+    bench_result r;
+    r.name = e.name;
+    r.family = e.family;
+    r.arg = e.arg;
+    std::function<void()> body = e.setup ? e.setup() : e.body;
+    r.iterations = Calibrate(body);
+    stopwatch_t sw("", false);
+
+    //  retake disturbed samples, but give up after 3x the wanted count so a
+    //  busy machine still produces a result
+    r.samples.reserve(m_samples);
+    for (unsigned attempt = 0; r.samples.size() < m_samples; ++attempt) {
+        long switches = bench_env::ContextSwitches();
+        sw.Start(nullptr);
+        for (unsigned long i = 0; i < r.iterations; ++i)
+            body();
+        double lap = (double)sw.Stop(nullptr) / (double)r.iterations;
+        if (!m_keep_noisy && bench_env::ContextSwitches() != switches && attempt < 3 * m_samples) {
+            ++r.discarded;
+            continue;
+        }
+        r.samples.push_back(lap);
+    }
+    return r;
+}
+
+template <typename T> inline void basic_bench<T>::EnvEnter() {
+    m_env = bench_env();
+#if defined(__linux__)
+    pthread_getaffinity_np(pthread_self(), sizeof(m_saved_affinity), &m_saved_affinity);
+    pthread_getschedparam(pthread_self(), &m_saved_policy, &m_saved_param);
+    if (m_pin) {
+        int cpu = m_cpu < 0 ? bench_env::PickCore() : m_cpu;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+                m_env.cpu = cpu;
+        }
+        if (m_fifo) {
+            struct sched_param param;
+            param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+            m_env.fifo = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+        }
+    }
+    m_env.Probe(m_env.cpu >= 0 ? m_env.cpu : sched_getcpu());
+#else
+    m_env.Probe(0);
+#endif
+
+    m_log << "bench: cpu ";
+    if (m_env.cpu >= 0)
+        m_log << m_env.cpu;
+    else
+        m_log << "unpinned";
+    m_log << (m_env.fifo ? " SCHED_FIFO" : "")
+          << " governor " << (m_env.governor.empty() ? "unknown" : m_env.governor)
+          << " turbo " << (m_env.turbo.empty() ? "unknown" : m_env.turbo) << std::endl;
+    if (m_pin && m_env.cpu < 0)
+        m_log << "bench: warning: can't pin to a core" << std::endl;
+    if (m_fifo && !m_env.fifo)
+        m_log << "bench: warning: SCHED_FIFO not permitted" << std::endl;
+    if (!m_env.governor.empty() && m_env.governor != "performance")
+        m_log << "bench: warning: governor " << m_env.governor << " scales frequency" << std::endl;
+    if (m_env.turbo == "on")
+        m_log << "bench: warning: turbo is on" << std::endl;
+    m_log << std::flush;
+}
+
+template <typename T> inline void basic_bench<T>::EnvLeave() {
+#if defined(__linux__)
+    if (m_env.fifo)
+        pthread_setschedparam(pthread_self(), m_saved_policy, &m_saved_param);
+    if (m_env.cpu >= 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(m_saved_affinity), &m_saved_affinity);
+#endif
+}
+
+template <typename T> inline void basic_bench<T>::RunnerFifo(bool on) {
+#if defined(__linux__)
+    if (!m_env.fifo)
+        return;
+    if (on) {
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    } else {
+        pthread_setschedparam(pthread_self(), m_saved_policy, &m_saved_param);
+    }
+#else
+    (void)on;
+#endif
+}
+
+//  workers wait at a start barrier so they begin together; the wall time runs
+//  from releasing them to joining the last one. The runner drops SCHED_FIFO
+//  while the workers start up and blocks until they are all at the barrier, so
+//  it can't starve a worker sharing its core; it is FIFO again only from the
+//  release to the last join
+template <typename T> inline bench_result basic_bench<T>::MeasureThreaded(entry const& e, unsigned k, unsigned long iterations) {
+    bench_result r;
+    std::ostringstream name;
+    name << e.name << "/threads:" << k;
+    r.name = name.str();
+    r.iterations = iterations;
+    r.threads = k;
+    r.samples.reserve(m_samples);
+    r.thread_samples.reserve((size_t)m_samples * k);
+
+    std::vector<double> laps(k);
+    for (unsigned s = 0; s < m_samples; ++s) {
+        std::mutex ready_mutex;
+        std::condition_variable ready_cv;
+        unsigned ready = 0;
+        std::atomic<bool> go(false);
+        std::vector<std::thread> workers;
+        RunnerFifo(false);
+        for (unsigned t = 0; t < k; ++t) {
+            workers.push_back(std::thread([&, t]() {
+#if defined(__linux__)
+                //  don't inherit the runner's pinning or SCHED_FIFO
+                if (m_env.cpu >= 0)
+                    pthread_setaffinity_np(pthread_self(), sizeof(m_saved_affinity), &m_saved_affinity);
+                if (m_env.fifo)
+                    pthread_setschedparam(pthread_self(), m_saved_policy, &m_saved_param);
+#endif
+                stopwatch_t sw("", false);
+                {
+                    std::lock_guard<std::mutex> lock(ready_mutex);
+                    if (++ready == k)
+                        ready_cv.notify_one();
+                }
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                sw.Start(nullptr);
+                for (unsigned long i = 0; i < iterations; ++i)
+                    e.threaded(t);
+                laps[t] = (double)sw.Stop(nullptr) / (double)iterations;
+            }));
+        }
+        {
+            std::unique_lock<std::mutex> lock(ready_mutex);
+            ready_cv.wait(lock, [&]() { return ready == k; });
+        }
+        RunnerFifo(true);
+
+        stopwatch_t wall("", false);
+        wall.Start(nullptr);
+        go.store(true, std::memory_order_release);
+        for (unsigned t = 0; t < k; ++t)
+            workers[t].join();
+        double lap = (double)wall.Stop(nullptr);
+
+        r.samples.push_back(lap / ((double)iterations * (double)k));
+        r.thread_samples.insert(r.thread_samples.end(), laps.begin(), laps.end());
+    }
+    return r;
+}
+
+template <typename T> inline void basic_bench<T>::Report(bench_result const& r, bench_result const* single) {
+    m_log << r.name << ": " << r.Median() << unit() << " (median of "
+          << r.samples.size() << " x " << r.iterations;
+    if (r.discarded)
+        m_log << ", " << r.discarded << " discarded";
+    m_log << ")";
+    double median = r.Median();
+    if (!r.family.empty() && median > 0.0)
+        m_log << " " << (double)r.arg / (median * unit_seconds()) << " items/s";
+    if (r.threads && median > 0.0) {
+        std::vector<double> t(r.thread_samples);
+        std::sort(t.begin(), t.end());
+        m_log << " " << 1.0 / (median * unit_seconds()) << " ops/s per-thread p50 "
+              << t[t.size() / 2] << unit() << " p99 " << t[t.size() * 99 / 100] << unit()
+              << " max " << t.back() << unit();
+        if (single && single->Median() > 0.0)
+            m_log << " efficiency " << 100.0 * single->Median() / ((double)r.threads * median) << "%";
+    }
+    m_log << std::endl << std::flush;
+}
+
+template <typename T> inline void basic_bench<T>::Run() {
+    m_results.clear();
+    EnvEnter();
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+        entry const& e = m_entries[i];
+        if (!e.threaded) {
+            m_results.push_back(Measure(e));
+            Report(m_results.back(), nullptr);
+            continue;
+        }
+
+        //  size the iteration count on one thread, then keep it for all counts
+        unsigned long iterations = Calibrate(std::bind(e.threaded, 0u));
+        size_t single = m_results.size();
+        for (unsigned k = 1; ; k = k * 2 < e.max_threads ? k * 2 : e.max_threads) {
+            m_results.push_back(MeasureThreaded(e, k, iterations));
+            Report(m_results.back(), &m_results[single]);
+            if (k == e.max_threads)
+                break;
+        }
+    }
+    EnvLeave();
+    ReportComplexity();
+}
+
+template <typename T> inline void basic_bench<T>::ReportComplexity() {
+    std::vector<std::string> done;
+    for (size_t i = 0; i < m_results.size(); ++i) {
+        std::string const& family = m_results[i].family;
+        if (family.empty() || std::find(done.begin(), done.end(), family) != done.end())
+            continue;
+        done.push_back(family);
+
+        std::vector<std::pair<double, double> > points;
+        for (size_t j = i; j < m_results.size(); ++j) {
+            if (m_results[j].family == family)
+                points.push_back(std::make_pair((double)m_results[j].arg, m_results[j].Median()));
+        }
+        if (points.size() < 3)
+            continue;
+        double coef, rms;
+        char const* big_o = bench_complexity(points, coef, rms);
+        m_log << family << ": " << big_o << " " << coef << unit() << " rms "
+              << rms * 100.0 << "%" << std::endl << std::flush;
+    }
+}
+
+template <typename T> inline bool basic_bench<T>::SaveBaseline(std::string const& path) const {
+    std::ofstream os(path.c_str());
+    if (!os)
+        return false;
+    os.precision(17);
+    os << "{\"version\":1,\"unit\":\"" << unit() << "\",\"env\":{\"cpu\":" << m_env.cpu
+       << ",\"fifo\":" << (m_env.fifo ? "true" : "false")
+       << ",\"governor\":\"" << m_env.governor << "\",\"turbo\":\"" << m_env.turbo << "\"},\"benchmarks\":[";
+    for (size_t i = 0; i < m_results.size(); ++i) {
+        bench_result const& r = m_results[i];
+        os << (i ? "," : "") << "\n{\"name\":\"";
+        for (size_t c = 0; c < r.name.size(); ++c) {
+            if (r.name[c] == '"' || r.name[c] == '\\')
+                os << '\\';
+            os << r.name[c];
+        }
+        os << "\",\"iterations\":" << r.iterations << ",\"discarded\":" << r.discarded << ",\"samples\":[";
+        for (size_t s = 0; s < r.samples.size(); ++s)
+            os << (s ? "," : "") << r.samples[s];
+        os << "]}";
+    }
+    os << "\n]}\n";
+    return (bool)os;
+}
+
+//  reads the subset of JSON SaveBaseline() writes: benchmark objects with
+//  "name", "iterations" and "samples" keys, other keys are skipped
+template <typename T> inline bool basic_bench<T>::LoadBaseline(std::string const& path, std::vector<bench_result>& out) {
+    std::ifstream is(path.c_str());
+    if (!is)
+        return false;
+    std::stringstream ss;
+    ss << is.rdbuf();
+    std::string const text = ss.str();
+
+    out.clear();
+    bench_result cur;
+    std::string key;
+    bool have_name = false;
+    for (size_t p = 0; p < text.size(); ) {
+        char c = text[p];
+        if (c == '"') {
+            std::string str;
+            for (++p; p < text.size() && text[p] != '"'; ++p) {
+                if (text[p] == '\\' && p + 1 < text.size())
+                    ++p;
+                str += text[p];
+            }
+            ++p;
+            size_t q = p;
+            while (q < text.size() && std::isspace((unsigned char)text[q]))
+                ++q;
+            if (q < text.size() && text[q] == ':') {
+                key = str;
+                p = q + 1;
+            }
+            else if (key == "name") {
+                cur.name = str;
+                have_name = true;
+            }
+        }
+        else if (c == '[' && key == "samples") {
+            char const* s = text.c_str() + p + 1;
+            char* end;
+            for (;;) {
+                double v = std::strtod(s, &end);
+                if (end == s)
+                    break;
+                cur.samples.push_back(v);
+                s = end;
+                while (*s == ',' || std::isspace((unsigned char)*s))
+                    ++s;
+            }
+            p = (size_t)(s - text.c_str());
+            key.clear();
+        }
+        else if ((c == '-' || std::isdigit((unsigned char)c)) && key == "iterations") {
+            char* end;
+            cur.iterations = std::strtoul(text.c_str() + p, &end, 10);
+            p = (size_t)(end - text.c_str());
+            key.clear();
+        }
+        else if (c == '}') {
+            if (have_name)
+                out.push_back(cur);
+            cur = bench_result();
+            have_name = false;
+            ++p;
+        }
+        else {
+            ++p;
+        }
+    }
+    return true;
+}
+
+template <typename T> inline int basic_bench<T>::CompareBaseline(std::vector<bench_result> const& baseline, double alpha, double threshold) const {
+    int regressions = 0;
+    for (size_t i = 0; i < m_results.size(); ++i) {
+        bench_result const& r = m_results[i];
+        bench_result const* base = nullptr;
+        for (size_t j = 0; j < baseline.size() && !base; ++j) {
+            if (baseline[j].name == r.name)
+                base = &baseline[j];
+        }
+        if (!base) {
+            m_log << r.name << ": not in baseline" << std::endl << std::flush;
+            continue;
+        }
+
+        double before = base->Median(), after = r.Median();
+        double change = before > 0.0 ? (after - before) / before : 0.0;
+        double p = bench_mann_whitney(base->samples, r.samples);
+        char const* verdict = "same";
+        if (p < alpha && change > threshold) {
+            verdict = "REGRESSION";
+            ++regressions;
+        }
+        else if (p < alpha && change < -threshold) {
+            verdict = "improved";
+        }
+        m_log << r.name << ": " << before << unit() << " -> " << after << unit() << " "
+              << (change >= 0.0 ? "+" : "") << change * 100.0 << "% p=" << p << " " << verdict
+              << std::endl << std::flush;
+    }
+    return regressions;
+}
+
+template <typename T> inline int basic_bench<T>::Main(int argc, char** argv) {
+    char const* save = nullptr;
+    char const* compare = nullptr;
+    double alpha = 0.01, threshold = 0.02;
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--save-baseline") && has_value)
+            save = argv[++i];
+        else if (!std::strcmp(argv[i], "--compare") && has_value)
+            compare = argv[++i];
+        else if (!std::strcmp(argv[i], "--samples") && has_value)
+            SamplesSet((unsigned)std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--alpha") && has_value)
+            alpha = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--threshold") && has_value)
+            threshold = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--cpu") && has_value)
+            PinSet(std::atoi(argv[++i]), m_fifo);
+        else if (!std::strcmp(argv[i], "--fifo"))
+            PinSet(m_cpu, true);
+        else if (!std::strcmp(argv[i], "--keep-noisy"))
+            KeepNoisySet(true);
+        else {
+            m_log << argv[0] << ": unknown option " << argv[i] << std::endl << std::flush;
+            return 2;
+        }
+    }
+
+    std::vector<bench_result> baseline;
+    if (compare && !LoadBaseline(compare, baseline)) {
+        m_log << argv[0] << ": can't read baseline " << compare << std::endl << std::flush;
+        return 2;
+    }
+
+    Run();
+
+    if (save && !SaveBaseline(save)) {
+        m_log << argv[0] << ": can't write baseline " << save << std::endl << std::flush;
+        return 2;
+    }
+    if (compare && CompareBaseline(baseline, alpha, threshold) > 0)
+        return 1;
+    return 0;
+}
+
+typedef basic_bench< TimerBaseChrono< std::chrono::steady_clock, std::chrono::nanoseconds> > Benchmark;
+
+# endif
@@ -0,0 +1,328 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_CHANGE_H
+#define PERF_STOPWATCH_CHANGE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "stopwatchformat.h"
+
+/*******************************************************************************
+ *  class stopwatch_changepoint -- notice when an activity gets slower
+ *
+ *  Watches the stream of laps of an activity and raises an event when their
+ *  level or their tail shifts, so the process itself reports "net.request
+ *  got 20% slower at 14:02" instead of a dashboard hours later. Each lap
+ *  costs O(1): a couple of multiplications and compares under a mutex.
+ *
+ *      void Serve() {
+ *          Stopwatchmicro sw("");
+ *          ...
+ *          sw.Stop(nullptr);
+ *          stopwatch_changepoint::Get("net.request").RecordLap(sw);
+ *      }
+ *
+ *  What it prints (or passes to the handler set with SetHandler())
+ *      "changepoint net.request: geomean +21.3% (4021331ns -> 4878120ns) at 2026-10-17 14:02:11, lap 120345"
+ *      "changepoint net.request: tail 5.0% -> 14.2% over 9120331ns at 2026-10-17 14:02:13, lap 120410"
+ *
+ *  How
+ *      baseline    the first 1024 laps (after start or after a change) give
+ *                  the mean and deviation of log(lap) and the 95th
+ *                  percentile; logs make the test relative, so a 20% shift
+ *                  looks the same at 10uS and at 10mS
+ *      level       two sided CUSUM on the standardized log laps, slack
+ *                  half a deviation, alarm at 12 deviations accumulated;
+ *                  levels are reported as geometric means, exp of the
+ *                  mean log, which sit below the arithmetic mean of skewed
+ *                  laps
+ *      tail        Bernoulli CUSUM on laps above the baseline 95th
+ *                  percentile, testing 5% against 10%, alarm at 12
+ *  After a change the detector takes a new baseline at the new level.
+ *  MeanRunLength() gives the average laps to an alarm of the level test
+ *  (Siegmund's approximation, for independent normal log laps): with the
+ *  default threshold about 520000 on stationary laps, and about 80 for a
+ *  20% shift at a log deviation of 0.3. That assumes the baseline is
+ *  exact; estimated from 1024 laps, simulation gives about one false alarm
+ *  of the level test in 450000 stationary laps, and the tail test adds one
+ *  in 2 million. Real laps are correlated and heavier tailed than that,
+ *  expect more false alarms. The "after" level is the geometric mean since
+ *  the CUSUM last left 0, which overstates small shifts somewhat.
+ *
+ *  Record() also takes aggregates, e.g. the mean or p99 of each second,
+ *  for activities too hot to feed lap by lap.
+ *
+ ********************************************************************************/
+
+struct stopwatch_change {
+    enum kind_t { mean_up, mean_down, tail_up };   // mean_* are shifts of the geometric mean
+
+    char const*         activity;
+    kind_t              kind;
+    double              before;         // geometric mean nS, or tail fraction
+    double              after;
+    double              threshold_ns;   // tail only, the baseline 95th percentile
+    unsigned long long  lap;            // laps seen when it was detected
+    std::time_t         when;
+};
+
+class stopwatch_changepoint {
+public:
+    static size_t const baseline_laps = 1024;
+
+    typedef std::function<void(stopwatch_change const&)> handler;
+
+    // the detector of an activity, created on first use. activity must
+    // outlive the program (a string literal)
+    static stopwatch_changepoint& Get(char const* activity);
+
+    // where changes go, by default one line on std::cout. Set before laps
+    // are recorded
+    static void SetHandler(handler h);
+
+    explicit stopwatch_changepoint(char const* activity,
+                                   double mean_threshold = 12.0, double tail_threshold = 12.0);
+
+    // add a lap or an aggregate in nS, true if it completed a change
+    bool Record(unsigned long long ns);
+
+    // add the last lap of a stopwatch
+    template <typename Stopwatch> bool RecordLap(Stopwatch const& sw) {
+        return Record(stopwatch_unit<typename Stopwatch::duration>::ToNs(sw.LapGet()));
+    }
+
+    char const* Activity() const { return m_activity; }
+
+    // write a change the way the default handler does
+    static void Print(std::ostream& os, stopwatch_change const& c);
+
+    // average laps until the level test alarms when log laps are shifted by
+    // shift deviations, 0 for the false alarm run length
+    static double MeanRunLength(double shift, double threshold = 12.0);
+
+private:
+    stopwatch_changepoint(stopwatch_changepoint const&);
+    stopwatch_changepoint& operator=(stopwatch_changepoint const&);
+
+    struct registry {
+        std::mutex                          mutex;
+        std::deque<stopwatch_changepoint>   detectors;  // deque keeps addresses stable
+        handler                             on_change;
+    };
+
+    static registry& Registry() {
+        static registry r;
+        return r;
+    }
+
+    // CUSUM allowance per lap of the level test, in deviations
+    static double Slack() { return 0.5; }
+
+    void Rebaseline();                      // m_mutex held
+    void Learn();                           // m_mutex held
+    void Raise(stopwatch_change& c);
+
+    char const*         m_activity;
+    double              m_mean_threshold;
+    double              m_tail_threshold;
+
+    std::mutex          m_mutex;
+    unsigned long long  m_laps;
+
+    //  baseline, from the first laps after start or a change
+    std::vector<unsigned long long> m_warmup;
+    double              m_mu;               // mean of log(lap)
+    double              m_sigma;            // deviation of log(lap)
+    double              m_p95;              // nS
+
+    //  mean CUSUM, with the sum of z since each side was last 0
+    double              m_up;
+    double              m_down;
+    double              m_up_z;
+    double              m_down_z;
+    unsigned long long  m_up_n;
+    unsigned long long  m_down_n;
+
+    //  tail CUSUM, with the exceedances since it was last 0
+    double              m_tail;
+    unsigned long long  m_tail_hits;
+    unsigned long long  m_tail_n;
+};
+
+inline stopwatch_changepoint::stopwatch_changepoint(char const* activity, double mean_threshold, double tail_threshold)
+  : m_activity(activity)
+  , m_mean_threshold(mean_threshold)
+  , m_tail_threshold(tail_threshold)
+  , m_laps(0)
+{
+    Rebaseline();
+}
+
+inline stopwatch_changepoint& stopwatch_changepoint::Get(char const* activity) {
+    registry& r = Registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (size_t i = 0; i < r.detectors.size(); ++i) {
+        if (!std::strcmp(r.detectors[i].m_activity, activity))
+            return r.detectors[i];
+    }
+    r.detectors.emplace_back(activity);
+    return r.detectors.back();
+}
+
+inline void stopwatch_changepoint::SetHandler(handler h) {
+    registry& r = Registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.on_change = h;
+}
+
+inline void stopwatch_changepoint::Rebaseline() {
+    m_warmup.clear();
+    m_warmup.reserve(baseline_laps);
+    m_mu = m_sigma = m_p95 = 0.0;
+    m_up = m_down = m_up_z = m_down_z = 0.0;
+    m_up_n = m_down_n = 0;
+    m_tail = 0.0;
+    m_tail_hits = m_tail_n = 0;
+}
+
+//  the baseline is complete: mean and deviation of the logs, 95th percentile
+inline void stopwatch_changepoint::Learn() {
+    double sum = 0.0, sq = 0.0;
+    for (size_t i = 0; i < m_warmup.size(); ++i) {
+        double x = std::log((double)m_warmup[i] + 1.0);
+        sum += x;
+        sq += x * x;
+    }
+    double n = (double)m_warmup.size();
+    m_mu = sum / n;
+    m_sigma = std::sqrt(std::max(sq / n - m_mu * m_mu, 0.0));
+    // laps with a resolution of whole units can have no spread at all
+    m_sigma = std::max(m_sigma, 0.01);
+    size_t k = m_warmup.size() * 95 / 100;
+    std::nth_element(m_warmup.begin(), m_warmup.begin() + (long)k, m_warmup.end());
+    m_p95 = (double)m_warmup[k];
+    m_warmup.clear();
+}
+
+inline bool stopwatch_changepoint::Record(unsigned long long ns) {
+    stopwatch_change c;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_laps;
+        if (m_sigma == 0.0) {
+            m_warmup.push_back(ns);
+            if (m_warmup.size() == baseline_laps)
+                Learn();
+            return false;
+        }
+
+        double z = (std::log((double)ns + 1.0) - m_mu) / m_sigma;
+        if (m_up <= 0.0) {
+            m_up_z = 0.0;
+            m_up_n = 0;
+        }
+        if (m_down <= 0.0) {
+            m_down_z = 0.0;
+            m_down_n = 0;
+        }
+        m_up = std::max(0.0, m_up + z - Slack());
+        m_down = std::max(0.0, m_down - z - Slack());
+        m_up_z += z;
+        ++m_up_n;
+        m_down_z += z;
+        ++m_down_n;
+
+        // Bernoulli log likelihood ratio of 10% against 5% exceedances
+        static double const p0 = 0.05, p1 = 0.10;
+        bool hit = (double)ns > m_p95;
+        if (m_tail <= 0.0)
+            m_tail_hits = m_tail_n = 0;
+        m_tail = std::max(0.0, m_tail + (hit ? std::log(p1 / p0) : std::log((1.0 - p1) / (1.0 - p0))));
+        m_tail_hits += hit;
+        ++m_tail_n;
+
+        c.activity = m_activity;
+        c.threshold_ns = 0.0;
+        c.lap = m_laps;
+        c.when = std::time(nullptr);
+        if (m_up > m_mean_threshold || m_down > m_mean_threshold) {
+            bool up = m_up > m_mean_threshold;
+            double mean_z = up ? m_up_z / (double)m_up_n : m_down_z / (double)m_down_n;
+            c.kind = up ? stopwatch_change::mean_up : stopwatch_change::mean_down;
+            c.before = std::exp(m_mu) - 1.0;
+            c.after = std::exp(m_mu + mean_z * m_sigma) - 1.0;
+        }
+        else if (m_tail > m_tail_threshold) {
+            c.kind = stopwatch_change::tail_up;
+            c.before = 1.0 - 0.95;
+            c.after = (double)m_tail_hits / (double)m_tail_n;
+            c.threshold_ns = m_p95;
+        }
+        else {
+            return false;
+        }
+        Rebaseline();
+    }
+    Raise(c);
+    return true;
+}
+
+inline void stopwatch_changepoint::Raise(stopwatch_change& c) {
+    handler h;
+    {
+        registry& r = Registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        h = r.on_change;
+    }
+    if (h)
+        h(c);
+    else
+        Print(std::cout, c);
+}
+
+//  Siegmund's approximation for a one sided CUSUM with drift d per lap,
+//  (exp(-2 d b) + 2 d b - 1) / (2 d^2) with b = threshold + 1.166; the two
+//  sides alarm independently, so their rates add
+inline double stopwatch_changepoint::MeanRunLength(double shift, double threshold) {
+    double b = threshold + 1.166;
+    double side[2] = { shift - Slack(), -shift - Slack() };
+    double rate = 0.0;
+    for (int i = 0; i < 2; ++i) {
+        double d = side[i];
+        double arl = std::fabs(d) < 1e-9 ? b * b : (std::exp(-2.0 * d * b) + 2.0 * d * b - 1.0) / (2.0 * d * d);
+        rate += 1.0 / arl;
+    }
+    return 1.0 / rate;
+}
+
+inline void stopwatch_changepoint::Print(std::ostream& os, stopwatch_change const& c) {
+    char when[32];
+    std::tm tm;
+#if defined(_WIN32)
+    localtime_s(&tm, &c.when);
+#else
+    localtime_r(&c.when, &tm);
+#endif
+    std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    char const* ns = stopwatch_unit<std::chrono::nanoseconds>::suffix();
+    char line[160];
+    if (c.kind == stopwatch_change::tail_up)
+        std::snprintf(line, sizeof(line), "tail %.1f%% -> %.1f%% over %.0f%s",
+                      100.0 * c.before, 100.0 * c.after, c.threshold_ns, ns);
+    else
+        std::snprintf(line, sizeof(line), "geomean %+.1f%% (%.0f%s -> %.0f%s)",
+                      c.before > 0.0 ? 100.0 * (c.after / c.before - 1.0) : 0.0, c.before, ns, c.after, ns);
+    os << "changepoint " << c.activity << ": " << line << " at " << when << ", lap " << c.lap
+       << std::endl << std::flush;
+}
+
+# endif
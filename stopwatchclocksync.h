@@ -0,0 +1,243 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_CLOCKSYNC_H
+#define PERF_STOPWATCH_CLOCKSYNC_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+/*******************************************************************************
+ *  class basic_clocksync -- map fast clock readings to wall clock (UTC)
+ *
+ *  Fast monotonic clocks (steady_clock, cycle counters) have no wall-clock
+ *  meaning. basic_clocksync takes paired samples of (fast clock, realtime
+ *  clock) and writes each pair into the same log stream the stopwatches use.
+ *  The CSV, JSON and logfmt formatters put the raw clock reading at Start()
+ *  on every show and stop line ("start"), so an offline tool can convert
+ *  each of them to UTC, and the end of the lap from start plus lap. Between
+ *  two samples the conversion interpolates linearly, which corrects for the
+ *  drift between the two clocks.
+ *
+ *  The clock must be the one of the stopwatch's timer base; clocksync_for<>
+ *  takes it from the stopwatch type, so the two can't disagree:
+ *
+ *      typedef basic_stopwatch< TimerBaseChrono< std::chrono::steady_clock,
+ *                                                std::chrono::microseconds>,
+ *                               stopwatch_format_json > StopwatchTrace;
+ *      clocksync_for<StopwatchTrace> sync;     // prints "clocksync: t u"
+ *      StopwatchTrace sw("TheThing()");        // "start":<ticks> on its lines
+ *      ...
+ *      sync.Poll(std::chrono::seconds(10));    // resample every 10 seconds
+ *      long long utc_ns = sync.ToUtcNs(sw.GetStartTicks());
+ *
+ *  What it prints for every sample
+ *      Sample():                       "clocksync: <ticks> <utc nS>"
+ *
+ *  Samples are taken when the caller asks: Sample() always, Poll() when the
+ *  interval has passed, so a loop that runs often can call Poll() on every
+ *  pass. StartSampling(interval) takes them on a background thread instead,
+ *  until StopSampling() or destruction; its samples go to the same log
+ *  from that thread. Interpolation takes out a steady drift; what the
+ *  interval bounds is the error from the drift changing between samples,
+ *  with temperature or when NTP starts or stops slewing the realtime clock
+ *  (at most 500 ppm). Every 1 to 10 seconds suits most logs; the 64
+ *  samples kept by default then cover one to ten minutes of lines for
+ *  ToUtcNs().
+ *
+ *  The clock is read through clock_ticks<clock_>, which can be specialized
+ *  for clocks that are not std::chrono clocks (e.g. a cycle counter).
+ *
+ ********************************************************************************/
+
+//  raw tick reader, specialize for non-chrono clocks
+template <typename clock_> struct clock_ticks {
+    static long long now() {
+        return (long long)clock_::now().time_since_epoch().count();
+    }
+
+    //  nominal tick length, used until two samples are available
+    static double nominal_ns_per_tick() {
+        return 1e9 * (double)clock_::period::num / (double)clock_::period::den;
+    }
+};
+
+template <typename clock_> class basic_clocksync {
+public:
+    struct sample {
+        long long ticks;    // fast clock reading
+        long long utc_ns;   // realtime clock, nS since 1970-01-01 UTC
+    };
+
+    // create, optionally take a first sample
+    explicit basic_clocksync(bool sample_now = true);
+    explicit basic_clocksync(std::ostream& log,
+                             bool sample_now = true,
+                             size_t capacity = 64);
+
+    // take a paired sample now, log it, return it
+    sample Sample();
+
+    // take a sample if at least interval has passed since the last one
+    template <typename duration> bool Poll(duration interval);
+
+    // take a sample every interval on a background thread, replacing one
+    // already running
+    template <typename duration> void StartSampling(duration interval);
+
+    // stop the background thread, if any
+    void StopSampling();
+
+    ~basic_clocksync();
+
+    // convert a fast clock reading to nS since the epoch (UTC)
+    long long ToUtcNs(long long ticks) const;
+
+    // number of samples currently kept
+    size_t Size() const;
+
+private:
+    basic_clocksync(basic_clocksync const&);
+    basic_clocksync& operator=(basic_clocksync const&);
+
+    static long long RealtimeNs();
+
+    // the background thread
+    void Loop(std::chrono::nanoseconds interval);
+
+    mutable std::mutex      m_mutex;
+    std::deque<sample>      m_samples;  // oldest first, at most m_capacity
+    size_t                  m_capacity;
+    std::ostream&           m_log;      // stream on which to log samples
+    std::condition_variable m_cv;
+    bool                    m_stop;     // the background thread is to stop, under m_mutex
+    std::thread             m_thread;
+};
+
+template <typename clock_> inline basic_clocksync<clock_>::basic_clocksync(bool sample_now)
+  : m_capacity(64)
+  , m_log(std::cout)
+  , m_stop(false)
+{
+    if (sample_now)
+        Sample();
+}
+
+template <typename clock_> inline basic_clocksync<clock_>::basic_clocksync(std::ostream& log, bool sample_now, size_t capacity)
+  : m_capacity(capacity < 2 ? 2 : capacity)
+  , m_log(log)
+  , m_stop(false)
+{
+    if (sample_now)
+        Sample();
+}
+
+template <typename clock_> inline basic_clocksync<clock_>::~basic_clocksync() {
+    StopSampling();
+}
+
+template <typename clock_> inline long long basic_clocksync<clock_>::RealtimeNs() {
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+//  read fast/realtime/fast a few times and keep the tightest bracket, the
+//  fast clock value is the midpoint of the bracket
+template <typename clock_> inline typename basic_clocksync<clock_>::sample basic_clocksync<clock_>::Sample() {
+    sample best = { 0, 0 };
+    long long best_window = -1;
+    for (int i = 0; i < 5; ++i) {
+        long long t0 = clock_ticks<clock_>::now();
+        long long wall = RealtimeNs();
+        long long t1 = clock_ticks<clock_>::now();
+        if (best_window < 0 || t1 - t0 < best_window) {
+            best_window = t1 - t0;
+            best.ticks = t0 + (t1 - t0) / 2;
+            best.utc_ns = wall;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_samples.push_back(best);
+    if (m_samples.size() > m_capacity)
+        m_samples.pop_front();
+    m_log << "clocksync: " << best.ticks << " " << best.utc_ns << std::endl << std::flush;
+    return best;
+}
+
+template <typename clock_> template <typename duration> inline bool basic_clocksync<clock_>::Poll(duration interval) {
+    long long interval_ns = (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_samples.empty() && RealtimeNs() - m_samples.back().utc_ns < interval_ns)
+            return false;
+    }
+    Sample();
+    return true;
+}
+
+template <typename clock_> template <typename duration> inline void basic_clocksync<clock_>::StartSampling(duration interval) {
+    StopSampling();
+    std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(interval);
+    m_thread = std::thread(&basic_clocksync::Loop, this, ns);
+}
+
+template <typename clock_> inline void basic_clocksync<clock_>::StopSampling() {
+    if (!m_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = false;
+}
+
+template <typename clock_> inline void basic_clocksync<clock_>::Loop(std::chrono::nanoseconds interval) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cv.wait_for(lock, interval, [this] { return m_stop; })) {
+        lock.unlock();
+        Sample();
+        lock.lock();
+    }
+}
+
+//  interpolate between the bracketing samples, extrapolate from the
+//  nearest pair outside the sampled range
+template <typename clock_> inline long long basic_clocksync<clock_>::ToUtcNs(long long ticks) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_samples.empty())
+        return 0;
+    if (m_samples.size() == 1) {
+        sample const& s = m_samples.front();
+        return s.utc_ns + (long long)((double)(ticks - s.ticks) * clock_ticks<clock_>::nominal_ns_per_tick());
+    }
+
+    size_t hi = 1;
+    while (hi + 1 < m_samples.size() && m_samples[hi].ticks < ticks)
+        ++hi;
+    sample const& a = m_samples[hi - 1];
+    sample const& b = m_samples[hi];
+    if (b.ticks == a.ticks)
+        return a.utc_ns;
+    double slope = (double)(b.utc_ns - a.utc_ns) / (double)(b.ticks - a.ticks);
+    return a.utc_ns + (long long)((double)(ticks - a.ticks) * slope);
+}
+
+template <typename clock_> inline size_t basic_clocksync<clock_>::Size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_samples.size();
+}
+
+typedef basic_clocksync<std::chrono::steady_clock> clocksync_steady;
+
+//  the clocksync for the clock of a stopwatch type, e.g.
+//  clocksync_for<Stopwatchtsc>
+template <typename Stopwatch> using clocksync_for = basic_clocksync<typename Stopwatch::clock>;
+
+# endif
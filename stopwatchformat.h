@@ -0,0 +1,338 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_FORMAT_H
+#define PERF_STOPWATCH_FORMAT_H
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <ratio>
+
+/*******************************************************************************
+ *  stopwatch formatters -- output policies for basic_stopwatch
+ *
+ *  A formatter turns one stopwatch event into one line on the log stream.
+ *  basic_stopwatch takes it as its second template parameter:
+ *
+ *      typedef basic_stopwatch< TimerBaseChrono< std::chrono::steady_clock,
+ *                                                std::chrono::microseconds>,
+ *                               stopwatch_format_json > StopwatchJson;
+ *
+ *  What each formatter prints for Stop("parse") on activity "request" of a
+ *  microsecond stopwatch
+ *      stopwatch_format_text       request: parse 1042us
+ *      stopwatch_format_text_scaled request: parse 1.04ms
+ *      stopwatch_format_csv        request,stop,parse,1042,us,1734512003120331000
+ *      stopwatch_format_json       {"activity":"request","kind":"stop","event":"parse","lap":1042,"unit":"us","start":1734512003120331000}
+ *      stopwatch_format_logfmt     activity=request kind=stop event=parse lap=1042 unit=us start=1734512003120331000
+ *
+ *  kind is one of start, show, stop or error ("not started"); the lap is left
+ *  out for start and error. start is the raw clock reading at Start() of the
+ *  timer base (GetStartTicks()), which basic_clocksync converts to UTC, see
+ *  stopwatchclocksync.h; it is left out where the lap is, and where the timer
+ *  base has no GetStartTicks(). The text formats keep the plain lines. Lines are built in a local buffer with a
+ *  hand-rolled integer conversion and handed to the stream buffer in one
+ *  sputn(), so no iostream formatting or locale code runs per event.
+ *
+ *  The unit comes from the stopwatch's duration type through
+ *  stopwatch_unit<>, so the suffix and the conversion factors of the scaled
+ *  formatter are fixed at compile time.
+ *
+ *  A formatter is a class with one static member template
+ *      template <typename Duration>
+ *      static void Write(std::ostream& log, char const* activity,
+ *                        char const* event, stopwatch_event kind,
+ *                        unsigned long lap, long long start_ticks);
+ *
+ ********************************************************************************/
+
+enum stopwatch_event {
+    stopwatch_event_start,          // Start() while not running
+    stopwatch_event_show,           // Show() while running
+    stopwatch_event_stop,           // Stop(), or Start() while running
+    stopwatch_event_not_started     // Show()/Stop() while not running
+};
+
+//  unit suffix and nS conversion of a std::chrono duration type
+template <typename Period> struct stopwatch_unit_suffix         { static char const* get() { return "ticks"; } };
+template <> struct stopwatch_unit_suffix<std::nano>             { static char const* get() { return "ns"; } };
+template <> struct stopwatch_unit_suffix<std::micro>            { static char const* get() { return "us"; } };
+template <> struct stopwatch_unit_suffix<std::milli>            { static char const* get() { return "ms"; } };
+template <> struct stopwatch_unit_suffix<std::ratio<1> >        { static char const* get() { return "s"; } };
+template <> struct stopwatch_unit_suffix<std::ratio<60> >       { static char const* get() { return "min"; } };
+template <> struct stopwatch_unit_suffix<std::ratio<3600> >     { static char const* get() { return "h"; } };
+
+template <typename Duration> struct stopwatch_unit {
+    typedef std::ratio_divide<typename Duration::period, std::nano> to_ns;
+
+    static char const* suffix() {
+        return stopwatch_unit_suffix<typename Duration::period>::get();
+    }
+
+    static unsigned long long ToNs(unsigned long long v) {
+        return v * (unsigned long long)to_ns::num / (unsigned long long)to_ns::den;
+    }
+};
+
+//  line buffer that spills to the stream buffer when full
+class stopwatch_line {
+public:
+    explicit stopwatch_line(std::ostream& log) : m_log(log), m_len(0) { }
+
+    ~stopwatch_line() {
+        Put('\n');
+        Spill();
+        if (m_log.good())
+            m_log.flush();
+    }
+
+    void Put(char c) {
+        if (m_len == sizeof(m_buf))
+            Spill();
+        m_buf[m_len++] = c;
+    }
+
+    void Put(char const* s) {
+        while (*s)
+            Put(*s++);
+    }
+
+    // decimal digits without locale
+    void Put(unsigned long v) {
+        Put((unsigned long long)v);
+    }
+
+    void Put(unsigned long long v) {
+        char digits[24];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n)
+            Put(digits[--n]);
+    }
+
+    void PutSigned(long long v) {
+        if (v < 0) {
+            Put('-');
+            Put((unsigned long long)-(v + 1) + 1);
+            return;
+        }
+        Put((unsigned long long)v);
+    }
+
+    // v / div with precision decimals, truncated
+    void PutFixed(unsigned long long v, unsigned long long div, unsigned precision) {
+        Put((unsigned long)(v / div));
+        if (!precision)
+            return;
+        Put('.');
+        unsigned long long rem = v % div;
+        for (unsigned i = 0; i < precision; ++i) {
+            rem *= 10;
+            Put((char)('0' + rem / div));
+            rem %= div;
+        }
+    }
+
+private:
+    //  a short write sets badbit, as a formatted write would; lines are
+    //  finished in destructors, so a stream set to throw on it doesn't
+    void Spill() {
+        std::streambuf* buf = m_log.rdbuf();
+        if (m_len && (!buf || buf->sputn(m_buf, (std::streamsize)m_len) != (std::streamsize)m_len)) {
+            try {
+                m_log.setstate(std::ios::badbit);
+            } catch (...) {
+            }
+        }
+        m_len = 0;
+    }
+
+    std::ostream&   m_log;
+    size_t          m_len;
+    char            m_buf[256];
+};
+
+inline char const* stopwatch_event_kind(stopwatch_event kind) {
+    switch (kind) {
+    case stopwatch_event_start:     return "start";
+    case stopwatch_event_show:      return "show";
+    case stopwatch_event_stop:      return "stop";
+    default:                        return "error";
+    }
+}
+
+//  "activity: event", "activity: event at 12us", "activity: event 12us",
+//  AutoScale picks ns/us/ms/s by magnitude and prints Precision decimals
+template <bool AutoScale, unsigned Precision> struct basic_stopwatch_format_text {
+    template <typename Duration>
+    static void Write(std::ostream& log, char const* activity, char const* event,
+                      stopwatch_event kind, unsigned long lap, long long) {
+        stopwatch_line line(log);
+        line.Put(activity);
+        line.Put(": ");
+        if (kind == stopwatch_event_not_started) {
+            line.Put("not started");
+            return;
+        }
+        line.Put(event);
+        if (kind == stopwatch_event_start)
+            return;
+        line.Put(kind == stopwatch_event_show ? " at " : " ");
+        if (!AutoScale) {
+            line.Put(lap);
+            line.Put(stopwatch_unit<Duration>::suffix());
+            return;
+        }
+        unsigned long long ns = stopwatch_unit<Duration>::ToNs(lap);
+        if (ns >= 1000000000ULL) {
+            line.PutFixed(ns, 1000000000ULL, Precision);
+            line.Put("s");
+        }
+        else if (ns >= 1000000ULL) {
+            line.PutFixed(ns, 1000000ULL, Precision);
+            line.Put("ms");
+        }
+        else if (ns >= 1000ULL) {
+            line.PutFixed(ns, 1000ULL, Precision);
+            line.Put("us");
+        }
+        else {
+            line.Put((unsigned long)ns);
+            line.Put("ns");
+        }
+    }
+};
+
+typedef basic_stopwatch_format_text<false, 0> stopwatch_format_text;
+typedef basic_stopwatch_format_text<true, 2> stopwatch_format_text_scaled;
+
+//  activity,kind,event,lap,unit -- fields with , " or newlines are quoted
+struct stopwatch_format_csv {
+    static void Field(stopwatch_line& line, char const* s) {
+        if (!std::strpbrk(s, ",\"\r\n")) {
+            line.Put(s);
+            return;
+        }
+        line.Put('"');
+        for (; *s; ++s) {
+            if (*s == '"')
+                line.Put('"');
+            line.Put(*s);
+        }
+        line.Put('"');
+    }
+
+    template <typename Duration>
+    static void Write(std::ostream& log, char const* activity, char const* event,
+                      stopwatch_event kind, unsigned long lap, long long start_ticks) {
+        stopwatch_line line(log);
+        Field(line, activity);
+        line.Put(',');
+        line.Put(stopwatch_event_kind(kind));
+        line.Put(',');
+        Field(line, kind == stopwatch_event_not_started ? "not started" : event);
+        line.Put(',');
+        if (kind == stopwatch_event_show || kind == stopwatch_event_stop)
+            line.Put(lap);
+        line.Put(',');
+        line.Put(stopwatch_unit<Duration>::suffix());
+        line.Put(',');
+        if ((kind == stopwatch_event_show || kind == stopwatch_event_stop) && start_ticks)
+            line.PutSigned(start_ticks);
+    }
+};
+
+//  one JSON object per line
+struct stopwatch_format_json {
+    static void String(stopwatch_line& line, char const* s) {
+        static char const hex[] = "0123456789abcdef";
+        line.Put('"');
+        for (; *s; ++s) {
+            unsigned char c = (unsigned char)*s;
+            if (c == '"' || c == '\\') {
+                line.Put('\\');
+                line.Put((char)c);
+            }
+            else if (c < 0x20) {
+                line.Put("\\u00");
+                line.Put(hex[c >> 4]);
+                line.Put(hex[c & 15]);
+            }
+            else {
+                line.Put((char)c);
+            }
+        }
+        line.Put('"');
+    }
+
+    template <typename Duration>
+    static void Write(std::ostream& log, char const* activity, char const* event,
+                      stopwatch_event kind, unsigned long lap, long long start_ticks) {
+        stopwatch_line line(log);
+        line.Put("{\"activity\":");
+        String(line, activity);
+        line.Put(",\"kind\":\"");
+        line.Put(stopwatch_event_kind(kind));
+        line.Put("\",\"event\":");
+        String(line, kind == stopwatch_event_not_started ? "not started" : event);
+        if (kind == stopwatch_event_show || kind == stopwatch_event_stop) {
+            line.Put(",\"lap\":");
+            line.Put(lap);
+            line.Put(",\"unit\":\"");
+            line.Put(stopwatch_unit<Duration>::suffix());
+            line.Put('"');
+            if (start_ticks) {
+                line.Put(",\"start\":");
+                line.PutSigned(start_ticks);
+            }
+        }
+        line.Put('}');
+    }
+};
+
+//  key=value pairs, values with spaces, = or " are quoted
+struct stopwatch_format_logfmt {
+    static void Value(stopwatch_line& line, char const* s) {
+        if (*s && !std::strpbrk(s, " =\"\t\r\n")) {
+            line.Put(s);
+            return;
+        }
+        line.Put('"');
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\')
+                line.Put('\\');
+            if (*s == '\n')
+                line.Put("\\n");
+            else
+                line.Put(*s);
+        }
+        line.Put('"');
+    }
+
+    template <typename Duration>
+    static void Write(std::ostream& log, char const* activity, char const* event,
+                      stopwatch_event kind, unsigned long lap, long long start_ticks) {
+        stopwatch_line line(log);
+        line.Put("activity=");
+        Value(line, activity);
+        line.Put(" kind=");
+        line.Put(stopwatch_event_kind(kind));
+        line.Put(" event=");
+        Value(line, kind == stopwatch_event_not_started ? "not started" : event);
+        if (kind == stopwatch_event_show || kind == stopwatch_event_stop) {
+            line.Put(" lap=");
+            line.Put(lap);
+            line.Put(" unit=");
+            line.Put(stopwatch_unit<Duration>::suffix());
+            if (start_ticks) {
+                line.Put(" start=");
+                line.PutSigned(start_ticks);
+            }
+        }
+    }
+};
+
+# endif
@@ -0,0 +1,261 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_GAUGE_H
+#define PERF_STOPWATCH_GAUGE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include "stopwatchformat.h"
+#include "stopwatchshards.h"
+
+/*******************************************************************************
+ *  class stopwatch_gauge -- how many stopwatches of an activity run at once
+ *
+ *  A gauge counts the running stopwatches of one registered activity. Each
+ *  thread keeps the start times, completions and busy time of its scopes in
+ *  a shard of its own, which only it writes; a read sums the shards, taking
+ *  each one whole under a sequence count, and integrates concurrency over
+ *  time. That gives the time weighted average concurrency between two
+ *  reads, next to the throughput and mean latency of the scopes that
+ *  finished. Little's law says the average concurrency L equals throughput
+ *  times mean latency (lambda * W); the report prints both sides. A thread
+ *  preempted halfway through an update is counted as of the previous read,
+ *  which skews that one interval and evens out in the next.
+ *
+ *  Gauges are switched on per activity through the registry:
+ *
+ *      stopwatch_registry::Instance().Gauge("net.*");
+ *      ...
+ *      void Serve() {
+ *          Stopwatchmicro sw(STOPWATCH_SITE("net.request"));
+ *          ...
+ *      }
+ *      ...
+ *      stopwatch_registry::Instance().ReportGauges();      // every interval
+ *
+ *  What it reports, for the interval since the previous report
+ *      "gauge net.request: now 4 avg 3.92 peak 7, 812.3/s, mean 4830211ns, L 3.92 lambda*W 3.92"
+ *
+ *  When latency rises, a rising L points at queueing, a flat one at slower
+ *  work. Now and peak are summed from the shards as well, so starting and
+ *  stopping touch no shared counter: each thread keeps the most of its
+ *  scopes that ran at once in the interval, and peak is the sum of those,
+ *  an upper bound on the most that ran at once, which is reached when the
+ *  threads' busiest moments coincide.
+ *  Only admitted stopwatches count: sampled out or disabled ones don't run.
+ *  A thread's shard is handed to the next new thread when it exits, and a
+ *  gauge may go before the threads that used it, see stopwatchshards.h.
+ *
+ ********************************************************************************/
+
+class stopwatch_gauge {
+public:
+    // what a Sample() saw over the interval since the previous one
+    struct reading {
+        double              seconds;            // interval length
+        long long           running;            // running at the end
+        long long           peak;               // summed per thread most running in the interval
+        unsigned long long  completed;          // scopes finished
+        double              concurrency;        // time weighted average running
+        double              throughput;         // completed per second
+        double              mean_latency_ns;    // of the completed scopes
+    };
+
+    explicit stopwatch_gauge(char const* activity);
+
+    char const* Activity() const { return m_activity; }
+
+    // a stopwatch starts, returns its start time for Exit()
+    long long Enter();
+
+    // a stopwatch started at enter_ns stops
+    void Exit(long long enter_ns);
+
+    // scopes running now
+    long long Running() const;
+
+    // read the shards and start the next interval
+    reading Sample();
+
+    // one line for a reading
+    void Print(std::ostream& os, reading const& r) const;
+
+private:
+    stopwatch_gauge(stopwatch_gauge const&);
+    stopwatch_gauge& operator=(stopwatch_gauge const&);
+
+    struct totals {
+        long long   running;
+        long long   peak;           // most running in the interval numbered interval
+        unsigned    interval;
+        long long   enter_ns;       // summed start times of the running scopes
+        long long   completed;
+        long long   busy_ns;        // summed times of the completed scopes
+    };
+
+    //  what one thread's scopes add up to, written by that thread only. seq
+    //  is odd while it updates; the padding keeps the reader's fields and
+    //  the next shard off the writer's cache line
+    struct shard {
+        std::atomic<unsigned>   seq;
+        std::atomic<long long>  running;
+        std::atomic<long long>  peak;
+        std::atomic<unsigned>   interval;
+        std::atomic<long long>  enter_ns;
+        std::atomic<long long>  completed;
+        std::atomic<long long>  busy_ns;
+        char                    pad[64];
+        totals                  read;           // last whole read, under m_mutex
+
+        shard() : seq(0), running(0), peak(0), interval(0), enter_ns(0), completed(0), busy_ns(0) {
+            read.running = read.peak = read.enter_ns = read.completed = read.busy_ns = 0;
+            read.interval = 0;
+        }
+    };
+
+    //  add to a field of the calling thread's shard, its only writer
+    static void Add(std::atomic<long long>& field, long long delta) {
+        field.store(field.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    long long Now() const {
+        return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - m_epoch).count();
+    }
+
+    char const*                             m_activity;
+    std::chrono::steady_clock::time_point   m_epoch;
+    std::atomic<unsigned>                   m_interval;     // Sample() calls so far
+
+    stopwatch_shards<shard>                 m_shards;
+
+    std::mutex                              m_mutex;        // guards the last sample and shard reads
+    long long                               m_last_ns;
+    double                                  m_last_integral;
+    long long                               m_last_completed;
+    long long                               m_last_busy;
+};
+
+inline stopwatch_gauge::stopwatch_gauge(char const* activity)
+  : m_activity(activity)
+  , m_epoch(std::chrono::steady_clock::now())
+  , m_interval(0)
+  , m_last_ns(0)
+  , m_last_integral(0.0)
+  , m_last_completed(0)
+  , m_last_busy(0)
+{
+}
+
+//  the clock is read inside the update, so a thread preempted between
+//  reading it and storing can't be counted at the wrong time
+inline long long stopwatch_gauge::Enter() {
+    shard& s = m_shards.Local();
+    unsigned interval = m_interval.load(std::memory_order_relaxed);
+    unsigned seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    long long now = Now();
+    Add(s.enter_ns, now);
+    long long running = s.running.load(std::memory_order_relaxed) + 1;
+    s.running.store(running, std::memory_order_relaxed);
+    if (s.interval.load(std::memory_order_relaxed) != interval) {
+        s.interval.store(interval, std::memory_order_relaxed);
+        s.peak.store(running, std::memory_order_relaxed);
+    }
+    else if (running > s.peak.load(std::memory_order_relaxed))
+        s.peak.store(running, std::memory_order_relaxed);
+    s.seq.store(seq + 2, std::memory_order_release);
+    return now;
+}
+
+inline void stopwatch_gauge::Exit(long long enter_ns) {
+    shard& s = m_shards.Local();
+    unsigned seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    long long now = Now();
+    Add(s.busy_ns, now - enter_ns);
+    Add(s.completed, 1);
+    Add(s.running, -1);
+    Add(s.enter_ns, -enter_ns);
+    s.seq.store(seq + 2, std::memory_order_release);
+}
+
+inline long long stopwatch_gauge::Running() const {
+    long long running = 0;
+    m_shards.ForEach([&running](shard& s) { running += s.running.load(std::memory_order_relaxed); });
+    return running;
+}
+
+//  the integral of concurrency up to now is the time of the completed scopes
+//  plus, for each running scope, now minus its start. A shard is read again
+//  if its thread updated it meanwhile; when that thread stays in the middle
+//  of an update (preempted) its last whole read stands in, which is off for
+//  this interval only, the integral is cumulative. Now is read after the
+//  shards, so it is past every start counted. A thread's peak is the most it
+//  ran in the interval, or as it started the interval, the previous read,
+//  when it started no scope since
+inline stopwatch_gauge::reading stopwatch_gauge::Sample() {
+    long long running = 0, peak = 0, enter = 0, completed = 0, busy = 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned interval = m_interval.load(std::memory_order_relaxed);
+    m_shards.ForEach([&](shard& s) {
+        long long shard_peak = s.read.running;
+        for (unsigned attempt = 0; attempt < 64; ++attempt) {
+            unsigned seq = s.seq.load(std::memory_order_acquire);
+            totals t;
+            t.running = s.running.load(std::memory_order_relaxed);
+            t.peak = s.peak.load(std::memory_order_relaxed);
+            t.interval = s.interval.load(std::memory_order_relaxed);
+            t.enter_ns = s.enter_ns.load(std::memory_order_relaxed);
+            t.completed = s.completed.load(std::memory_order_relaxed);
+            t.busy_ns = s.busy_ns.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!(seq & 1) && s.seq.load(std::memory_order_relaxed) == seq) {
+                s.read = t;
+                break;
+            }
+        }
+        if (s.read.interval == interval && s.read.peak > shard_peak)
+            shard_peak = s.read.peak;
+        if (s.read.running > shard_peak)
+            shard_peak = s.read.running;
+        running += s.read.running;
+        peak += shard_peak;
+        enter += s.read.enter_ns;
+        completed += s.read.completed;
+        busy += s.read.busy_ns;
+    });
+    m_interval.store(interval + 1, std::memory_order_relaxed);
+    long long now = Now();
+    double integral = (double)busy + (double)running * (double)now - (double)enter;
+
+    reading r;
+    double interval_ns = (double)(now - m_last_ns);
+    r.seconds = interval_ns / 1e9;
+    r.running = running;
+    r.peak = peak;
+    r.completed = (unsigned long long)(completed - m_last_completed);
+    r.concurrency = interval_ns > 0.0 ? (integral - m_last_integral) / interval_ns : 0.0;
+    r.throughput = r.seconds > 0.0 ? (double)r.completed / r.seconds : 0.0;
+    r.mean_latency_ns = r.completed ? (double)(busy - m_last_busy) / (double)r.completed : 0.0;
+    m_last_ns = now;
+    m_last_integral = integral;
+    m_last_completed = completed;
+    m_last_busy = busy;
+    return r;
+}
+
+inline void stopwatch_gauge::Print(std::ostream& os, reading const& r) const {
+    char line[160];
+    std::snprintf(line, sizeof(line), "now %lld avg %.2f peak %lld, %.1f/s, mean %.0f%s, L %.2f lambda*W %.2f",
+                  r.running, r.concurrency, r.peak, r.throughput, r.mean_latency_ns,
+                  stopwatch_unit<std::chrono::nanoseconds>::suffix(), r.concurrency, r.throughput * r.mean_latency_ns / 1e9);
+    os << "gauge " << m_activity << ": " << line << std::endl << std::flush;
+}
+
+# endif
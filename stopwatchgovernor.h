@@ -0,0 +1,203 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_GOVERNOR_H
+#define PERF_STOPWATCH_GOVERNOR_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include "stopwatchregistry.h"
+
+/*******************************************************************************
+ *  class stopwatch_governor -- keep stopwatch overhead within a CPU budget
+ *
+ *  While the governor runs, 1 in stopwatch_site::cost_stride registered
+ *  stopwatches times its own bookkeeping from Start() to Stop(): the clock
+ *  reads, the gauge and probe updates and the printing, but not the timed
+ *  work in between, and charges the thread CPU time it took, scaled up, to
+ *  its site. Every interval a background thread compares the total with the
+ *  process CPU time of the interval, so a log write that blocks or a thread
+ *  preempted in the middle of its bookkeeping isn't counted. Over
+ *  budget, the costliest sites are throttled one step at a time: each step
+ *  halves the share of their stopwatches that run, and a site at 1 in 1024
+ *  is switched off. Below a quarter of the budget, throttled sites get back
+ *  one step per interval. The governor keeps its own flag per site: a site
+ *  it switched back on stays off if a rule disabled it meanwhile, and rules
+ *  that enable a site don't lift the throttling.
+ *
+ *      stopwatch_governor gov(0.01);           // at most 1% of CPU
+ *      ...
+ *
+ *  What it prints when it changes a site
+ *      "stopwatch governor: net.parse 2.3% of CPU, running 1 in 4"
+ *      "stopwatch governor: net.parse disabled"
+ *      "stopwatch governor: net.parse 0.1% of CPU, running 1 in 2"
+ *
+ *  Only sites constructed through STOPWATCH_SITE() are accounted for.
+ *
+ ********************************************************************************/
+
+class stopwatch_governor {
+public:
+    static unsigned const max_shift = 10;   // 1 in 1024, then disable
+
+    // start governing, budget is a fraction of process CPU time
+    explicit stopwatch_governor(double budget = 0.01,
+                                std::chrono::milliseconds interval = std::chrono::milliseconds(1000),
+                                std::ostream& log = std::cout);
+
+    // stop governing, throttled sites stay as they are
+    ~stopwatch_governor();
+
+    // overhead fraction measured in the last interval
+    double LastFraction() const;
+
+private:
+    stopwatch_governor(stopwatch_governor const&);
+    stopwatch_governor& operator=(stopwatch_governor const&);
+
+    void Loop();
+
+    // CPU time of the whole process in nS
+    static long long ProcessCpuNs();
+
+    // one budget check, run by the background thread
+    void Check();
+
+    struct site_cost {
+        stopwatch_site*     site;
+        unsigned long long  ns;
+
+        bool operator<(site_cost const& other) const { return ns > other.ns; }
+    };
+
+    double                      m_budget;
+    std::chrono::milliseconds   m_interval;
+    std::ostream&               m_log;      // stream on which to log changes
+
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_cv;
+    bool                        m_stop;
+    long long                   m_last_cpu;     // nS
+    double                      m_last_fraction;
+    std::thread                 m_thread;
+};
+
+inline stopwatch_governor::stopwatch_governor(double budget, std::chrono::milliseconds interval, std::ostream& log)
+  : m_budget(budget)
+  , m_interval(interval)
+  , m_log(log)
+  , m_stop(false)
+  , m_last_cpu(ProcessCpuNs())
+  , m_last_fraction(0.0)
+{
+    stopwatch_governed().store(true, std::memory_order_relaxed);
+    m_thread = std::thread(&stopwatch_governor::Loop, this);
+}
+
+inline stopwatch_governor::~stopwatch_governor() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    stopwatch_governed().store(false, std::memory_order_relaxed);
+}
+
+inline double stopwatch_governor::LastFraction() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last_fraction;
+}
+
+inline void stopwatch_governor::Loop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cv.wait_for(lock, m_interval, [this] { return m_stop; })) {
+        lock.unlock();
+        Check();
+        lock.lock();
+    }
+}
+
+inline long long stopwatch_governor::ProcessCpuNs() {
+#if defined(CLOCK_PROCESS_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+        return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+    return (long long)((double)std::clock() * 1e9 / (double)CLOCKS_PER_SEC);
+}
+
+inline void stopwatch_governor::Check() {
+    long long now = ProcessCpuNs();
+    double cpu_ns = (double)(now - m_last_cpu);
+    m_last_cpu = now;
+
+    std::vector<site_cost> costs;
+    unsigned long long total = 0;
+    stopwatch_registry::Instance().ForEach([&](stopwatch_site& site) {
+        site_cost c;
+        c.site = &site;
+        c.ns = site.cost_ns.exchange(0, std::memory_order_relaxed);
+        total += c.ns;
+        costs.push_back(c);
+    });
+    if (cpu_ns <= 0.0)
+        return;
+    double fraction = (double)total / cpu_ns;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_last_fraction = fraction;
+    }
+
+    //  throttle the costliest sites until the estimate fits the budget,
+    //  assuming each step halves a site's cost. Sites with less than a tenth
+    //  of the total are left alone
+    if (fraction > m_budget) {
+        std::sort(costs.begin(), costs.end());
+        double excess = (double)total - m_budget * cpu_ns;
+        for (size_t i = 0; i < costs.size() && excess > 0.0 && costs[i].ns * 10 >= total; ++i) {
+            stopwatch_site& site = *costs[i].site;
+            unsigned shift = site.sample_shift.load(std::memory_order_relaxed);
+            site.throttled.store(true, std::memory_order_relaxed);
+            if (shift < max_shift) {
+                site.sample_shift.store(shift + 1, std::memory_order_relaxed);
+                m_log << "stopwatch governor: " << site.activity << " "
+                      << 100.0 * (double)costs[i].ns / cpu_ns << "% of CPU, running 1 in "
+                      << (1u << (shift + 1)) << std::endl << std::flush;
+            }
+            else {
+                site.governed.store(false, std::memory_order_relaxed);
+                m_log << "stopwatch governor: " << site.activity << " disabled" << std::endl << std::flush;
+            }
+            excess -= (double)costs[i].ns / 2.0;
+        }
+        return;
+    }
+
+    if (fraction < m_budget / 4.0) {
+        for (size_t i = 0; i < costs.size(); ++i) {
+            stopwatch_site& site = *costs[i].site;
+            if (!site.throttled.load(std::memory_order_relaxed))
+                continue;
+            unsigned shift = site.sample_shift.load(std::memory_order_relaxed);
+            if (!site.governed.load(std::memory_order_relaxed))
+                site.governed.store(true, std::memory_order_relaxed);
+            else if (shift > 0)
+                site.sample_shift.store(--shift, std::memory_order_relaxed);
+            if (shift == 0)
+                site.throttled.store(false, std::memory_order_relaxed);
+            m_log << "stopwatch governor: " << site.activity << " "
+                  << 100.0 * (double)costs[i].ns / cpu_ns << "% of CPU, running 1 in "
+                  << (1u << shift) << std::endl << std::flush;
+        }
+    }
+}
+
+# endif
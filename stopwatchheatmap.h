@@ -0,0 +1,355 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_HEATMAP_H
+#define PERF_STOPWATCH_HEATMAP_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "stopwatchformat.h"
+#include "stopwatchhist.h"
+
+/*******************************************************************************
+ *  class stopwatch_heatmap -- latency over time, one histogram per interval
+ *
+ *  Records the laps of an activity into a Histogram per time interval and
+ *  exports them as a matrix of time (rows) by latency bucket (columns), the
+ *  raw material of a latency heatmap. Bimodal latencies and periodic stalls
+ *  stand out there and vanish in averages and single percentiles.
+ *
+ *      stopwatch_heatmap heat("net.request", std::chrono::milliseconds(1000));
+ *      ...
+ *      {
+ *          Stopwatchmicro sw("");
+ *          Serve();
+ *          sw.Stop(nullptr);
+ *          heat.RecordLap(sw);
+ *      }
+ *      ...
+ *      heat.WriteCsv(csv);
+ *      heat.WriteSvg(svg);
+ *
+ *  Exports, latency buckets are 4 per power of two, from the smallest to
+ *  the largest one used
+ *      WriteCsv()      "time_ms,<bucket low nS>,..." then one line per
+ *                      interval, "<interval start ms>,<count>,..."
+ *      WriteBinary()   "SWHM", version 1, then varints: intervals, buckets,
+ *                      interval ms, first interval start ms, bucket lows,
+ *                      counts row by row
+ *      WriteSvg()      a self-contained SVG, time left to right, latency
+ *                      bottom to top on a log scale, color by log count
+ *
+ *  Closed intervals are kept serialized (Histogram::Serialize), a few
+ *  hundred bytes each, up to max_intervals of them; the oldest go first.
+ *  Intervals without laps are kept as empty rows, which take no memory; the
+ *  first Record() after a long idle gap adds them all at once, not one by
+ *  one. Record() is thread safe.
+ *
+ ********************************************************************************/
+
+class stopwatch_heatmap {
+public:
+    static unsigned const bucket_shift = Histogram::sub_bits - 2;   // 4 buckets per power of two
+
+    explicit stopwatch_heatmap(char const* activity,
+                               std::chrono::milliseconds interval = std::chrono::milliseconds(1000),
+                               size_t max_intervals = 3600);
+
+    // record a lap in nS
+    void Record(unsigned long long ns);
+
+    // record the last lap of a stopwatch
+    template <typename Stopwatch> void RecordLap(Stopwatch const& sw) {
+        Record(stopwatch_unit<typename Stopwatch::duration>::ToNs(sw.LapGet()));
+    }
+
+    // close the current interval now, even if it isn't over
+    void Roll();
+
+    // closed intervals kept
+    size_t Intervals() const;
+
+    // the histogram of closed interval i, oldest first
+    Histogram Interval(size_t i) const;
+
+    void WriteCsv(std::ostream& os) const;
+    void WriteBinary(std::string& out) const;
+    void WriteSvg(std::ostream& os, unsigned width = 960, unsigned height = 480) const;
+
+private:
+    stopwatch_heatmap(stopwatch_heatmap const&);
+    stopwatch_heatmap& operator=(stopwatch_heatmap const&);
+
+    typedef std::chrono::steady_clock clock;
+
+    //  counts of closed intervals, rows by columns
+    struct matrix {
+        long long                           start_ms;   // first row, since the heatmap was made
+        size_t                              first;      // first bucket column
+        size_t                              columns;
+        size_t                              rows;
+        std::vector<unsigned long long>     counts;
+        unsigned long long                  max;
+    };
+
+    void Advance(clock::time_point now);            // m_mutex held
+    void Close();                                   // m_mutex held
+    void Trim();                                    // m_mutex held
+    matrix Matrix() const;
+
+    //  an interval's histogram, empty rows are empty strings
+    static void Load(std::string const& s, Histogram& h) {
+        size_t pos = 0;
+        if (!s.empty())
+            h.Deserialize(s, pos);
+    }
+
+    static void Escape(std::ostream& os, char const* s);
+
+    static unsigned long long Low(size_t column) { return Histogram::BucketLow(column << bucket_shift); }
+    static void Latency(char* buf, size_t size, unsigned long long ns);
+    static void PutVarint(std::string& out, unsigned long long v);
+
+    char const*                 m_activity;
+    std::chrono::milliseconds   m_interval;
+    size_t                      m_max_intervals;
+
+    mutable std::mutex          m_mutex;
+    clock::time_point           m_epoch;
+    clock::time_point           m_start;        // of the current interval
+    Histogram                   m_current;
+    std::deque<std::string>     m_closed;       // serialized, oldest first
+    long long                   m_first_ms;     // start of m_closed.front()
+};
+
+inline stopwatch_heatmap::stopwatch_heatmap(char const* activity, std::chrono::milliseconds interval, size_t max_intervals)
+  : m_activity(activity)
+  , m_interval(interval.count() > 0 ? interval : std::chrono::milliseconds(1))
+  , m_max_intervals(max_intervals ? max_intervals : 1)
+  , m_epoch(clock::now())
+  , m_start(m_epoch)
+  , m_first_ms(0)
+{
+}
+
+//  drop the oldest rows beyond max_intervals, m_first_ms follows m_start
+inline void stopwatch_heatmap::Trim() {
+    while (m_closed.size() > m_max_intervals)
+        m_closed.pop_front();
+    m_first_ms = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(m_start - m_epoch).count()
+               - (long long)m_closed.size() * (long long)m_interval.count();
+}
+
+inline void stopwatch_heatmap::Close() {
+    std::string s;
+    if (m_current.Count())
+        m_current.Serialize(s);
+    m_closed.push_back(s);
+    m_current.Clear();
+    m_start += m_interval;
+    Trim();
+}
+
+//  close the current interval, then add the empty ones of a gap at once; a
+//  gap of max_intervals or more leaves nothing but empty rows
+inline void stopwatch_heatmap::Advance(clock::time_point now) {
+    long long elapsed = (long long)((now - m_start) / m_interval);
+    if (elapsed <= 0)
+        return;
+    Close();
+    unsigned long long empty = (unsigned long long)(elapsed - 1);
+    if (empty >= m_max_intervals)
+        m_closed.assign(m_max_intervals, std::string());
+    else
+        m_closed.insert(m_closed.end(), (size_t)empty, std::string());
+    m_start += m_interval * (long long)empty;
+    Trim();
+}
+
+inline void stopwatch_heatmap::Record(unsigned long long ns) {
+    clock::time_point now = clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Advance(now);
+    m_current.Record(ns);
+}
+
+inline void stopwatch_heatmap::Roll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Advance(clock::now());
+    Close();
+}
+
+inline size_t stopwatch_heatmap::Intervals() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_closed.size();
+}
+
+inline Histogram stopwatch_heatmap::Interval(size_t i) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Histogram h;
+    if (i < m_closed.size())
+        Load(m_closed[i], h);
+    return h;
+}
+
+inline stopwatch_heatmap::matrix stopwatch_heatmap::Matrix() const {
+    std::vector<Histogram> rows;
+    matrix m;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m.start_ms = m_first_ms;
+        rows.resize(m_closed.size());
+        for (size_t i = 0; i < m_closed.size(); ++i)
+            Load(m_closed[i], rows[i]);
+    }
+    size_t lo = (size_t)-1, hi = 0;
+    for (size_t r = 0; r < rows.size(); ++r) {
+        if (!rows[r].Count())
+            continue;
+        lo = std::min(lo, Histogram::BucketIndex(rows[r].Min()) >> bucket_shift);
+        hi = std::max(hi, Histogram::BucketIndex(rows[r].Max()) >> bucket_shift);
+    }
+    m.first = lo == (size_t)-1 ? 0 : lo;
+    m.columns = lo == (size_t)-1 ? 0 : hi - lo + 1;
+    m.rows = rows.size();
+    m.counts.assign(m.rows * m.columns, 0);
+    m.max = 0;
+    for (size_t r = 0; r < rows.size() && m.columns; ++r) {
+        for (size_t i = 0; i < Histogram::bucket_count; ++i) {
+            Histogram::count_t c = rows[r].BucketGet(i);
+            if (!c)
+                continue;
+            unsigned long long& cell = m.counts[r * m.columns + (i >> bucket_shift) - m.first];
+            cell += c;
+            m.max = std::max(m.max, cell);
+        }
+    }
+    return m;
+}
+
+inline void stopwatch_heatmap::WriteCsv(std::ostream& os) const {
+    matrix m = Matrix();
+    os << "time_ms";
+    for (size_t c = 0; c < m.columns; ++c)
+        os << "," << Low(m.first + c);
+    os << "\n";
+    for (size_t r = 0; r < m.rows; ++r) {
+        os << m.start_ms + (long long)r * (long long)m_interval.count();
+        for (size_t c = 0; c < m.columns; ++c)
+            os << "," << m.counts[r * m.columns + c];
+        os << "\n";
+    }
+    os << std::flush;
+}
+
+inline void stopwatch_heatmap::PutVarint(std::string& out, unsigned long long v) {
+    while (v >= 0x80) {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+inline void stopwatch_heatmap::WriteBinary(std::string& out) const {
+    matrix m = Matrix();
+    out.append("SWHM", 4);
+    out += (char)1;
+    PutVarint(out, m.rows);
+    PutVarint(out, m.columns);
+    PutVarint(out, (unsigned long long)m_interval.count());
+    PutVarint(out, (unsigned long long)m.start_ms);
+    for (size_t c = 0; c < m.columns; ++c)
+        PutVarint(out, Low(m.first + c));
+    for (size_t i = 0; i < m.counts.size(); ++i)
+        PutVarint(out, m.counts[i]);
+}
+
+inline void stopwatch_heatmap::Latency(char* buf, size_t size, unsigned long long ns) {
+    if (ns >= 1000000000ULL)
+        std::snprintf(buf, size, "%gs", (double)ns / 1e9);
+    else if (ns >= 1000000ULL)
+        std::snprintf(buf, size, "%gms", (double)ns / 1e6);
+    else if (ns >= 1000ULL)
+        std::snprintf(buf, size, "%gus", (double)ns / 1e3);
+    else
+        std::snprintf(buf, size, "%lluns", ns);
+}
+
+//  text content and attribute values for XML
+inline void stopwatch_heatmap::Escape(std::ostream& os, char const* s) {
+    for (; *s; ++s) {
+        switch (*s) {
+        case '&':   os << "&amp;";  break;
+        case '<':   os << "&lt;";   break;
+        case '>':   os << "&gt;";   break;
+        case '"':   os << "&quot;"; break;
+        default:    os << *s;       break;
+        }
+    }
+}
+
+inline void stopwatch_heatmap::WriteSvg(std::ostream& os, unsigned width, unsigned height) const {
+    matrix m = Matrix();
+    double const left = 70.0, right = 10.0, top = 28.0, bottom = 32.0;
+    double plot_w = (double)width - left - right;
+    double plot_h = (double)height - top - bottom;
+    double cell_w = m.rows ? plot_w / (double)m.rows : plot_w;
+    double cell_h = m.columns ? plot_h / (double)m.columns : plot_h;
+    char buf[256];
+
+    os << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height
+       << "\" font-family=\"sans-serif\" font-size=\"11\">\n";
+    os << "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n";
+    os << "<text x=\"" << left << "\" y=\"18\" font-size=\"14\">";
+    Escape(os, m_activity);
+    os << " latency</text>\n";
+
+    //  cells, hue from yellow to red and lightness by log count
+    double scale = m.max ? std::log(1.0 + (double)m.max) : 1.0;
+    for (size_t r = 0; r < m.rows; ++r) {
+        for (size_t c = 0; c < m.columns; ++c) {
+            unsigned long long n = m.counts[r * m.columns + c];
+            if (!n)
+                continue;
+            double t = std::log(1.0 + (double)n) / scale;
+            std::snprintf(buf, sizeof(buf),
+                          "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"hsl(%.0f,100%%,%.0f%%)\"><title>%llu</title></rect>\n",
+                          left + (double)r * cell_w, top + plot_h - (double)(c + 1) * cell_h,
+                          cell_w, cell_h, 50.0 * (1.0 - t), 90.0 - 55.0 * t, n);
+            os << buf;
+        }
+    }
+
+    //  latency axis, a label per power of two that fits
+    unsigned step = 1;
+    while (m.columns && (double)step * cell_h < 14.0)
+        step *= 2;
+    for (size_t c = 0; c <= m.columns; c += step) {
+        char label[32];
+        Latency(label, sizeof(label), Low(m.first + c));
+        std::snprintf(buf, sizeof(buf), "<text x=\"%.2f\" y=\"%.2f\" text-anchor=\"end\">%s</text>\n",
+                      left - 4.0, top + plot_h - (double)c * cell_h + 4.0, label);
+        os << buf;
+    }
+
+    //  time axis, about 8 labels, seconds since the heatmap was made
+    size_t every = m.rows > 8 ? (m.rows + 7) / 8 : 1;
+    for (size_t r = 0; r <= m.rows; r += every) {
+        double s = (double)(m.start_ms + (long long)r * (long long)m_interval.count()) / 1000.0;
+        std::snprintf(buf, sizeof(buf), "<text x=\"%.2f\" y=\"%.2f\" text-anchor=\"middle\">%gs</text>\n",
+                      left + (double)r * cell_w, top + plot_h + 16.0, s);
+        os << buf;
+    }
+    std::snprintf(buf, sizeof(buf),
+                  "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"none\" stroke=\"#888\"/>\n",
+                  left, top, plot_w, plot_h);
+    os << buf << "</svg>\n" << std::flush;
+}
+
+# endif
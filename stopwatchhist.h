@@ -0,0 +1,390 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_HIST_H
+#define PERF_STOPWATCH_HIST_H
+
+#include <cstddef>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*******************************************************************************
+ *  class basic_histogram -- log-linear histogram of stopwatch laps
+ *
+ *  Values below 2^(SubBits+1) get a bucket each. Above that every power of
+ *  two is split into 2^SubBits linear sub-buckets, so the relative error of
+ *  a bucket is at most 2^-SubBits (about 3% with the default of 5) over the
+ *  full 64 bit range.
+ *
+ *      Histogram h;
+ *      {
+ *          Stopwatchmicro sw("");
+ *          TheThing();
+ *          h.Record(sw.Stop(nullptr));
+ *      }
+ *      h.RecordBatch(laps, nlaps);     // replay recorded laps in bulk
+ *      h.Percentile(99.0);
+ *
+ *  RecordBatch() is a plain Record() loop: SIMD bucket indices (AVX2,
+ *  AVX-512CD) and interleaved sub-histograms measured no faster than it on
+ *  20M laps, the bucket increments dominate.
+ *
+ *  A histogram is not thread safe, keep one per thread and Merge() them on
+ *  read. Subtract() turns two snapshots of the same histogram into the
+ *  histogram of the interval between them, so readers never need to reset the
+ *  writer's histogram.
+ *
+ *      Histogram total;
+ *      total.Merge(per_thread[0]).Merge(per_thread[1]);
+ *      Histogram interval = total;
+ *      interval.Subtract(previous_total);
+ *
+ *  Serialized forms, both carry the format version and SubBits:
+ *      Serialize()/Deserialize()   binary: "SWH" version sub_bits, then
+ *                                  varints count min max sum, then
+ *                                  (index delta, count) for nonempty buckets
+ *      Print()/Parse()             text, one line:
+ *                                  "histogram 1 5 count min max sum i:c i:c ..."
+ *
+ ********************************************************************************/
+
+template <unsigned SubBits = 5> class basic_histogram {
+public:
+    typedef unsigned long long value_t;
+    typedef unsigned long long count_t;
+
+    static unsigned const sub_bits = SubBits;
+    static size_t const bucket_count = ((size_t)(63 - SubBits) << SubBits) + (2u << SubBits);
+
+    basic_histogram();
+
+    // record one value
+    void Record(value_t value);
+
+    // record an array of values
+    void RecordBatch(unsigned long long const* values, size_t n);
+    void RecordBatch(unsigned long const* values, size_t n);
+    void RecordBatch(unsigned int const* values, size_t n);
+
+    // forget all values
+    void Clear();
+
+    // add the values of other, O(buckets)
+    basic_histogram& Merge(basic_histogram const& other);
+
+    // remove the values of an earlier snapshot, O(buckets). Returns false
+    // (and clamps at 0) if earlier isn't a snapshot of this histogram
+    bool Subtract(basic_histogram const& earlier);
+
+    // compact binary form, appended to out
+    void Serialize(std::string& out) const;
+
+    // read a binary form starting at pos, advance pos past it
+    bool Deserialize(std::string const& in, size_t& pos);
+
+    // one line text form
+    void Print(std::ostream& os) const;
+
+    // read a text form written by Print()
+    bool Parse(std::istream& is);
+
+    // number of values, and their min, max, sum and mean
+    count_t Count() const       { return m_count; }
+    value_t Min() const         { return m_count ? m_min : 0; }
+    value_t Max() const         { return m_max; }
+    value_t Sum() const         { return m_sum; }
+    double  Mean() const        { return m_count ? (double)m_sum / (double)m_count : 0.0; }
+
+    // value below which pct percent of the values fall (upper bucket edge)
+    value_t Percentile(double pct) const;
+
+    // bucket access
+    count_t BucketGet(size_t index) const { return m_buckets[index]; }
+    static size_t BucketIndex(value_t value);
+    static value_t BucketLow(size_t index);
+    static value_t BucketHigh(size_t index);
+
+private:
+    static unsigned const format_version = 1;
+
+    static unsigned Msb(value_t value);
+    static void PutVarint(std::string& out, unsigned long long v);
+    static bool GetVarint(std::string const& in, size_t& pos, unsigned long long& v);
+    void RecomputeRange();
+    template <typename V> void RecordScalar(V const* values, size_t n);
+
+    std::vector<count_t> m_buckets;
+    count_t m_count;
+    value_t m_min;
+    value_t m_max;
+    value_t m_sum;
+};
+
+typedef basic_histogram<> Histogram;
+
+template <unsigned SubBits> inline basic_histogram<SubBits>::basic_histogram()
+  : m_buckets(bucket_count, 0)
+  , m_count(0)
+  , m_min(~0ULL)
+  , m_max(0)
+  , m_sum(0)
+{
+}
+
+template <unsigned SubBits> inline unsigned basic_histogram<SubBits>::Msb(value_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - (unsigned)__builtin_clzll(value | 1);
+#else
+    unsigned msb = 0;
+    value |= 1;
+    while (value >>= 1)
+        ++msb;
+    return msb;
+#endif
+}
+
+//  index = (shift << SubBits) + (value >> shift), shift = max(msb - SubBits, 0)
+template <unsigned SubBits> inline size_t basic_histogram<SubBits>::BucketIndex(value_t value) {
+    unsigned msb = Msb(value);
+    unsigned shift = msb > SubBits ? msb - SubBits : 0;
+    return ((size_t)shift << SubBits) + (size_t)(value >> shift);
+}
+
+template <unsigned SubBits> inline typename basic_histogram<SubBits>::value_t basic_histogram<SubBits>::BucketLow(size_t index) {
+    if (index < (2u << SubBits))
+        return index;
+    size_t shift = (index >> SubBits) - 1;
+    value_t mantissa = (value_t)(index - (shift << SubBits));
+    return mantissa << shift;
+}
+
+template <unsigned SubBits> inline typename basic_histogram<SubBits>::value_t basic_histogram<SubBits>::BucketHigh(size_t index) {
+    if (index + 1 >= bucket_count)
+        return ~0ULL;
+    return BucketLow(index + 1) - 1;
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::Record(value_t value) {
+    ++m_buckets[BucketIndex(value)];
+    ++m_count;
+    m_sum += value;
+    if (value < m_min)
+        m_min = value;
+    if (value > m_max)
+        m_max = value;
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::Clear() {
+    m_buckets.assign(bucket_count, 0);
+    m_count = 0;
+    m_min = ~0ULL;
+    m_max = 0;
+    m_sum = 0;
+}
+
+template <unsigned SubBits> template <typename V> inline void basic_histogram<SubBits>::RecordScalar(V const* values, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        Record(values[i]);
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::RecordBatch(unsigned long long const* values, size_t n) {
+    RecordScalar(values, n);
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::RecordBatch(unsigned long const* values, size_t n) {
+    RecordScalar(values, n);
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::RecordBatch(unsigned int const* values, size_t n) {
+    RecordScalar(values, n);
+}
+
+template <unsigned SubBits> inline basic_histogram<SubBits>& basic_histogram<SubBits>::Merge(basic_histogram const& other) {
+    for (size_t i = 0; i < bucket_count; ++i)
+        m_buckets[i] += other.m_buckets[i];
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_min < m_min)
+        m_min = other.m_min;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+    return *this;
+}
+
+template <unsigned SubBits> inline bool basic_histogram<SubBits>::Subtract(basic_histogram const& earlier) {
+    bool ok = true;
+    count_t count = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        if (m_buckets[i] < earlier.m_buckets[i]) {
+            m_buckets[i] = 0;
+            ok = false;
+        }
+        else {
+            m_buckets[i] -= earlier.m_buckets[i];
+        }
+        count += m_buckets[i];
+    }
+    m_count = count;
+    m_sum = m_sum >= earlier.m_sum ? m_sum - earlier.m_sum : 0;
+    RecomputeRange();
+    return ok;
+}
+
+//  exact min/max are lost by Subtract(), narrow them to the bucket edges
+template <unsigned SubBits> inline void basic_histogram<SubBits>::RecomputeRange() {
+    value_t max = m_max;
+    m_min = ~0ULL;
+    m_max = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        if (m_buckets[i]) {
+            m_min = BucketLow(i);
+            break;
+        }
+    }
+    for (size_t i = bucket_count; i-- > 0; ) {
+        if (m_buckets[i]) {
+            value_t high = BucketHigh(i);
+            m_max = high < max ? high : max;
+            break;
+        }
+    }
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::PutVarint(std::string& out, unsigned long long v) {
+    while (v >= 0x80) {
+        out += (char)(unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)(unsigned char)v;
+}
+
+template <unsigned SubBits> inline bool basic_histogram<SubBits>::GetVarint(std::string const& in, size_t& pos, unsigned long long& v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        unsigned char b = (unsigned char)in[pos++];
+        v |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::Serialize(std::string& out) const {
+    out += "SWH";
+    out += (char)format_version;
+    out += (char)SubBits;
+    PutVarint(out, m_count);
+    PutVarint(out, Min());
+    PutVarint(out, m_max);
+    PutVarint(out, m_sum);
+    size_t nonempty = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+        nonempty += m_buckets[i] != 0;
+    PutVarint(out, nonempty);
+    size_t last = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        if (m_buckets[i]) {
+            PutVarint(out, i - last);
+            PutVarint(out, m_buckets[i]);
+            last = i;
+        }
+    }
+}
+
+template <unsigned SubBits> inline bool basic_histogram<SubBits>::Deserialize(std::string const& in, size_t& pos) {
+    size_t p = pos;
+    if (in.size() < p + 5 || in.compare(p, 3, "SWH") != 0)
+        return false;
+    if ((unsigned char)in[p + 3] != format_version || (unsigned char)in[p + 4] != SubBits)
+        return false;
+    p += 5;
+
+    unsigned long long count, min, max, sum, nonempty;
+    if (!GetVarint(in, p, count) || !GetVarint(in, p, min) || !GetVarint(in, p, max)
+        || !GetVarint(in, p, sum) || !GetVarint(in, p, nonempty))
+        return false;
+    std::vector<count_t> buckets(bucket_count, 0);
+    unsigned long long index = 0;
+    for (unsigned long long n = 0; n < nonempty; ++n) {
+        unsigned long long delta, c;
+        if (!GetVarint(in, p, delta) || !GetVarint(in, p, c))
+            return false;
+        index += delta;
+        if (index >= bucket_count)
+            return false;
+        buckets[index] = c;
+    }
+
+    m_buckets.swap(buckets);
+    m_count = count;
+    m_min = count ? min : ~0ULL;
+    m_max = max;
+    m_sum = sum;
+    pos = p;
+    return true;
+}
+
+template <unsigned SubBits> inline void basic_histogram<SubBits>::Print(std::ostream& os) const {
+    os << "histogram " << format_version << " " << SubBits << " "
+       << m_count << " " << Min() << " " << m_max << " " << m_sum;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        if (m_buckets[i])
+            os << " " << i << ":" << m_buckets[i];
+    }
+    os << std::endl;
+}
+
+template <unsigned SubBits> inline bool basic_histogram<SubBits>::Parse(std::istream& is) {
+    std::string line;
+    if (!std::getline(is, line))
+        return false;
+    std::istringstream ls(line);
+    std::string tag;
+    unsigned version, sub_bits_in;
+    unsigned long long count, min, max, sum;
+    if (!(ls >> tag >> version >> sub_bits_in >> count >> min >> max >> sum))
+        return false;
+    if (tag != "histogram" || version != format_version || sub_bits_in != SubBits)
+        return false;
+
+    std::vector<count_t> buckets(bucket_count, 0);
+    size_t index;
+    char colon;
+    unsigned long long c;
+    while (ls >> index >> colon >> c) {
+        if (colon != ':' || index >= bucket_count)
+            return false;
+        buckets[index] = c;
+    }
+    if (!ls.eof())
+        return false;
+
+    m_buckets.swap(buckets);
+    m_count = count;
+    m_min = count ? min : ~0ULL;
+    m_max = max;
+    m_sum = sum;
+    return true;
+}
+
+template <unsigned SubBits> inline typename basic_histogram<SubBits>::value_t basic_histogram<SubBits>::Percentile(double pct) const {
+    if (m_count == 0)
+        return 0;
+    if (pct >= 100.0)
+        return m_max;
+    count_t rank = (count_t)(pct / 100.0 * (double)m_count);
+    if (rank >= m_count)
+        rank = m_count - 1;
+    count_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += m_buckets[i];
+        if (seen > rank) {
+            value_t high = BucketHigh(i);
+            return high < m_max ? high : m_max;
+        }
+    }
+    return m_max;
+}
+
+# endif
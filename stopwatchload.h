@@ -0,0 +1,216 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_LOAD_H
+#define PERF_STOPWATCH_LOAD_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "stopwatchclocksync.h"
+#include "stopwatchformat.h"
+#include "stopwatchhist.h"
+
+/*******************************************************************************
+ *  class basic_load_generator -- open loop load with honest tail latency
+ *
+ *  A closed loop benchmark sends the next call when the previous one
+ *  returns, so when the system stalls it also stops sending, and the calls
+ *  that would have waited behind the stall are never measured (coordinated
+ *  omission). The load generator sends on a fixed schedule instead: call i
+ *  is due at start + i / rate, whatever happened to the calls before it,
+ *  and its latency counts from when it was due, not from when a worker got
+ *  around to it.
+ *
+ *      load_generator load(2000.0, std::chrono::seconds(10), 4);
+ *      load_result r = load.Run([&] { client.Get("/health"); });
+ *      r.Print(std::cout, "health");
+ *
+ *  What it prints
+ *      "load health: 2000/s for 10s, 19998 sent, 1998.1/s achieved, 211 late, response p50 1203ns p99 8812033ns p99.9 41020331ns max 52011002ns, service p50 1190ns p99 90211ns max 4101222ns"
+ *
+ *  response    due time to completion, what a client at that rate sees
+ *  service     actual start to completion, what a closed loop would report
+ *  late        calls started more than a millisecond after they were due
+ *
+ *  The schedule is evenly spaced, or Poisson arrivals with the same mean
+ *  rate. Workers claim calls in order and sleep until each is due; size
+ *  the workers for the concurrency the target can reach, a call never
+ *  waits for a worker without it showing in its response time. Due times
+ *  are worked out as calls are claimed, nothing is allocated per call. The
+ *  clock is read through clock_ticks<Clock>, so a cycle counter (tsc_clock
+ *  from stopwatchtsc.h) can replace steady_clock.
+ *
+ *  stopwatch_record_corrected() fixes up a closed loop's histogram after
+ *  the fact, the way HdrHistogram does: a value longer than the expected
+ *  interval between calls also records the calls that would have been
+ *  sent meanwhile.
+ *
+ ********************************************************************************/
+
+enum load_schedule {
+    load_schedule_fixed,        // evenly spaced
+    load_schedule_poisson       // exponential gaps, same mean rate
+};
+
+struct load_result {
+    double              rate;           // calls per second asked for
+    double              seconds;        // schedule length
+    double              achieved;       // calls per second completed
+    unsigned long long  sent;
+    unsigned long long  late;           // started over a millisecond after due
+    Histogram           response_ns;    // due to completion
+    Histogram           service_ns;     // start to completion
+
+    load_result() : rate(0.0), seconds(0.0), achieved(0.0), sent(0), late(0) { }
+
+    void Print(std::ostream& os, char const* name) const {
+        char line[128];
+        std::snprintf(line, sizeof(line), "%g/s for %gs, %llu sent, %.1f/s achieved, %llu late",
+                      rate, seconds, sent, achieved, late);
+        char const* ns = stopwatch_unit<std::chrono::nanoseconds>::suffix();
+        os << "load " << name << ": " << line
+           << ", response p50 " << response_ns.Percentile(50.0) << ns << " p99 " << response_ns.Percentile(99.0)
+           << ns << " p99.9 " << response_ns.Percentile(99.9) << ns << " max " << response_ns.Max() << ns
+           << ", service p50 " << service_ns.Percentile(50.0) << ns << " p99 " << service_ns.Percentile(99.0)
+           << ns << " max " << service_ns.Max() << ns << std::endl << std::flush;
+    }
+};
+
+//  record value, plus the values the calls sent during it would have seen
+//  had the loop kept its schedule of one call every expected_interval
+inline void stopwatch_record_corrected(Histogram& h, unsigned long long value, unsigned long long expected_interval) {
+    h.Record(value);
+    if (!expected_interval)
+        return;
+    for (unsigned long long missed = value; missed > expected_interval; ) {
+        missed -= expected_interval;
+        h.Record(missed);
+    }
+}
+
+template <typename Clock = std::chrono::steady_clock> class basic_load_generator {
+public:
+    // rate calls per second for duration, spread over workers threads
+    basic_load_generator(double rate, std::chrono::nanoseconds duration, unsigned workers = 1,
+                         load_schedule schedule = load_schedule_fixed);
+
+    // run fn() on the schedule, return when every call has completed
+    template <typename Fn> load_result Run(Fn fn);
+
+private:
+    //  hands out the calls in order, due time in nS from the start
+    class schedule {
+    public:
+        schedule(double rate, long long end_ns, load_schedule kind)
+          : m_gap(1e9 / rate)
+          , m_end((double)end_ns)
+          , m_kind(kind)
+          , m_next(0)
+          , m_rng(0x5eed)
+          , m_exp(1.0 / m_gap)
+          , m_due(kind == load_schedule_poisson ? m_exp(m_rng) : 0.0)
+        {
+        }
+
+        // the next call, false past the end of the schedule
+        bool Next(long long& due_ns) {
+            if (m_kind == load_schedule_fixed) {
+                double t = (double)m_next.fetch_add(1, std::memory_order_relaxed) * m_gap;
+                due_ns = (long long)t;
+                return t < m_end;
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_due >= m_end)
+                return false;
+            due_ns = (long long)m_due;
+            m_due += m_exp(m_rng);
+            return true;
+        }
+
+    private:
+        double                                  m_gap;      // mean nS between calls
+        double                                  m_end;
+        load_schedule                           m_kind;
+        std::atomic<unsigned long long>         m_next;     // fixed: next call
+        std::mutex                              m_mutex;    // poisson: guards the rest
+        std::mt19937_64                         m_rng;
+        std::exponential_distribution<double>   m_exp;
+        double                                  m_due;
+    };
+
+    double                      m_rate;
+    std::chrono::nanoseconds    m_duration;
+    unsigned                    m_workers;
+    load_schedule               m_schedule;
+};
+
+typedef basic_load_generator<> load_generator;
+
+template <typename Clock>
+inline basic_load_generator<Clock>::basic_load_generator(double rate, std::chrono::nanoseconds duration,
+                                                         unsigned workers, load_schedule schedule)
+  : m_rate(rate > 0.0 ? rate : 1.0)
+  , m_duration(duration)
+  , m_workers(workers ? workers : 1)
+  , m_schedule(schedule)
+{
+}
+
+template <typename Clock> template <typename Fn> inline load_result basic_load_generator<Clock>::Run(Fn fn) {
+    static double const ns_per_tick = clock_ticks<Clock>::nominal_ns_per_tick();
+    schedule calls(m_rate, (long long)m_duration.count(), m_schedule);
+    std::vector<load_result> part(m_workers);
+    long long const late_ns = 1000000;
+
+    //  nS since the start of the schedule, which begins a millisecond from now
+    long long start = clock_ticks<Clock>::now() + (long long)(1e6 / ns_per_tick);
+    auto elapsed = [start](long long ticks) { return (long long)((double)(ticks - start) * ns_per_tick); };
+
+    //  each worker records into its own histograms, merged at the end
+    auto work = [&](unsigned w) {
+        load_result& r = part[w];
+        long long due;
+        while (calls.Next(due)) {
+            long long wait;
+            while ((wait = due - elapsed(clock_ticks<Clock>::now())) > 0)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+            long long begin = elapsed(clock_ticks<Clock>::now());
+            fn();
+            long long end = elapsed(clock_ticks<Clock>::now());
+            r.response_ns.Record((unsigned long long)(end - due));
+            r.service_ns.Record((unsigned long long)(end > begin ? end - begin : 0));
+            ++r.sent;
+            if (begin - due > late_ns)
+                ++r.late;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned w = 1; w < m_workers; ++w)
+        threads.push_back(std::thread(work, w));
+    work(0);
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    double seconds = (double)elapsed(clock_ticks<Clock>::now()) / 1e9;
+
+    load_result total;
+    total.rate = m_rate;
+    total.seconds = (double)m_duration.count() / 1e9;
+    for (unsigned w = 0; w < m_workers; ++w) {
+        total.response_ns.Merge(part[w].response_ns);
+        total.service_ns.Merge(part[w].service_ns);
+        total.sent += part[w].sent;
+        total.late += part[w].late;
+    }
+    total.achieved = seconds > 0.0 ? (double)total.sent / seconds : 0.0;
+    return total;
+}
+
+# endif
@@ -0,0 +1,406 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_LOCK_H
+#define PERF_STOPWATCH_LOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include "stopwatchformat.h"
+#include "stopwatchhist.h"
+#include "stopwatchshards.h"
+
+/*******************************************************************************
+ *  timed_mutex_wrapper, timed_shared_mutex_wrapper -- lock contention per name
+ *
+ *  Drop-in wrappers for a mutex type M that record, per lock name, how long
+ *  threads waited to acquire the lock and how long they held it, into
+ *  Histograms in nanoseconds. Acquiring tries try_lock() first; only when
+ *  that fails are the wait and the blocking lock() timed. Hold times are
+ *  timed for every 16th acquisition of a thread, so most uncontended locks
+ *  pay a counter increment in the thread's own shard and no clock read.
+ *  Counts and wait times are exact, hold percentiles are from the sample.
+ *
+ *      timed_mutex_wrapper<std::mutex> g_cache_lock("cache");
+ *      ...
+ *      std::lock_guard< timed_mutex_wrapper<std::mutex> > lock(g_cache_lock);
+ *
+ *      timed_shared_mutex_wrapper<std::shared_timed_mutex> g_table_lock("table");
+ *      std::shared_lock< timed_shared_mutex_wrapper<std::shared_timed_mutex> > read(g_table_lock);
+ *
+ *      lock_stats::Report();                   // every lock name
+ *
+ *  What it reports, per lock name and mode
+ *      "lock cache: 120345 acquired, 3.2% contended, wait p50 850ns p99 41200ns max 90311ns, hold p50 120ns p99 2100ns max 51022ns"
+ *      "lock table shared: ..."
+ *
+ *  Wrappers with the same name share one lock_stats, e.g. all the bucket
+ *  locks of a hash table. Each thread records into its own shard of the
+ *  lock_stats, a counter and two histograms behind a mutex only readers
+ *  ever contend, so bucket locks with one name don't serialize on their
+ *  stats. Reads merge the shards. A thread's shard is handed to the next
+ *  new thread when it exits. Hold times are recorded after the wrapped
+ *  lock has been released. Sampled shared holds are kept for up to 8
+ *  shared locks held at once per thread, beyond that not timed.
+ *
+ *  The clock is read through clock_ticks<Clock>, so a cycle counter
+ *  (tsc_clock from stopwatchtsc.h) can replace steady_clock.
+ *
+ ********************************************************************************/
+
+template <typename Clock = std::chrono::steady_clock> class basic_lock_stats {
+public:
+    // one acquisition in hold_sample per thread has its hold time recorded
+    static unsigned const hold_sample = 16;
+
+    // the stats of a lock name, created on first use. name must outlive the
+    // program (a string literal)
+    static basic_lock_stats& Get(char const* name);
+
+    // call f(stats) for every lock name
+    template <typename Fn> static void ForEach(Fn f);
+
+    // print every lock name that was acquired
+    static void Report(std::ostream& os = std::cout);
+
+    char const* Name() const { return m_name; }
+
+    // record one acquisition, wait_ticks 0 if try_lock() got it. true if
+    // its hold time is to be recorded
+    bool RecordAcquire(bool shared, bool contended, long long wait_ticks);
+    void RecordHold(bool shared, long long hold_ticks);
+
+    // copies of the histograms, nS
+    Histogram Wait(bool shared = false) const;
+    Histogram Hold(bool shared = false) const;
+
+    unsigned long long Acquired(bool shared = false) const;
+    unsigned long long Contended(bool shared = false) const;
+
+    // one line per mode that was used
+    void Print(std::ostream& os) const;
+
+    explicit basic_lock_stats(char const* name);
+
+private:
+    //  counters are written by the shard's thread only, read by anyone
+    struct mode {
+        Histogram                       wait;
+        Histogram                       hold;
+        std::atomic<unsigned long long> acquired;
+        std::atomic<unsigned long long> contended;
+
+        mode() : acquired(0), contended(0) { }
+    };
+
+    //  what one thread recorded
+    struct shard {
+        mutable std::mutex  mutex;  // held by the thread to record, by readers to merge
+        mode        m[2];           // exclusive, shared
+    };
+
+    basic_lock_stats(basic_lock_stats const&);
+    basic_lock_stats& operator=(basic_lock_stats const&);
+
+    static void Increment(std::atomic<unsigned long long>& n) {
+        n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    //  the shards of one mode merged
+    void Merge(bool shared, Histogram* wait, Histogram* hold,
+               unsigned long long* acquired, unsigned long long* contended) const;
+
+    void PrintMode(std::ostream& os, bool shared, char const* label) const;
+
+    char const*                 m_name;
+    stopwatch_shards<shard>     m_shards;
+};
+
+typedef basic_lock_stats<> lock_stats;
+
+template <typename Clock> inline basic_lock_stats<Clock>::basic_lock_stats(char const* name)
+  : m_name(name)
+{
+}
+
+template <typename Clock> inline basic_lock_stats<Clock>& basic_lock_stats<Clock>::Get(char const* name) {
+    return stopwatch_names<basic_lock_stats>::Get(name);
+}
+
+template <typename Clock> template <typename Fn> inline void basic_lock_stats<Clock>::ForEach(Fn f) {
+    stopwatch_names<basic_lock_stats>::ForEach(f);
+}
+
+template <typename Clock> inline void basic_lock_stats<Clock>::Report(std::ostream& os) {
+    ForEach([&os](basic_lock_stats& s) { s.Print(os); });
+}
+
+template <typename Clock> inline bool basic_lock_stats<Clock>::RecordAcquire(bool shared, bool contended, long long wait_ticks) {
+    shard& s = m_shards.Local();
+    mode& m = s.m[shared];
+    Increment(m.acquired);
+    if (contended) {
+        Increment(m.contended);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        m.wait.Record(clock_ticks_ns<Clock>(wait_ticks));
+    }
+    return m.acquired.load(std::memory_order_relaxed) % hold_sample == 0;
+}
+
+template <typename Clock> inline void basic_lock_stats<Clock>::RecordHold(bool shared, long long hold_ticks) {
+    shard& s = m_shards.Local();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.m[shared].hold.Record(clock_ticks_ns<Clock>(hold_ticks));
+}
+
+template <typename Clock>
+inline void basic_lock_stats<Clock>::Merge(bool shared, Histogram* wait, Histogram* hold,
+                                           unsigned long long* acquired, unsigned long long* contended) const {
+    m_shards.ForEach([&](shard const& s) {
+        mode const& m = s.m[shared];
+        if (acquired)
+            *acquired += m.acquired.load(std::memory_order_relaxed);
+        if (contended)
+            *contended += m.contended.load(std::memory_order_relaxed);
+        if (wait || hold) {
+            std::lock_guard<std::mutex> shard_lock(s.mutex);
+            if (wait)
+                wait->Merge(m.wait);
+            if (hold)
+                hold->Merge(m.hold);
+        }
+    });
+}
+
+template <typename Clock> inline Histogram basic_lock_stats<Clock>::Wait(bool shared) const {
+    Histogram h;
+    Merge(shared, &h, nullptr, nullptr, nullptr);
+    return h;
+}
+
+template <typename Clock> inline Histogram basic_lock_stats<Clock>::Hold(bool shared) const {
+    Histogram h;
+    Merge(shared, nullptr, &h, nullptr, nullptr);
+    return h;
+}
+
+template <typename Clock> inline unsigned long long basic_lock_stats<Clock>::Acquired(bool shared) const {
+    unsigned long long n = 0;
+    Merge(shared, nullptr, nullptr, &n, nullptr);
+    return n;
+}
+
+template <typename Clock> inline unsigned long long basic_lock_stats<Clock>::Contended(bool shared) const {
+    unsigned long long n = 0;
+    Merge(shared, nullptr, nullptr, nullptr, &n);
+    return n;
+}
+
+template <typename Clock> inline void basic_lock_stats<Clock>::PrintMode(std::ostream& os, bool shared, char const* label) const {
+    Histogram wait, hold;
+    unsigned long long acquired = 0, contended = 0;
+    Merge(shared, &wait, &hold, &acquired, &contended);
+    if (!acquired)
+        return;
+    char const* ns = stopwatch_unit<std::chrono::nanoseconds>::suffix();
+    char pct[32];
+    std::snprintf(pct, sizeof(pct), "%.1f%%", 100.0 * (double)contended / (double)acquired);
+    os << "lock " << m_name << label << ": " << acquired << " acquired, " << pct << " contended"
+       << ", wait p50 " << wait.Percentile(50.0) << ns << " p99 " << wait.Percentile(99.0)
+       << ns << " max " << wait.Max() << ns
+       << ", hold p50 " << hold.Percentile(50.0) << ns << " p99 " << hold.Percentile(99.0)
+       << ns << " max " << hold.Max() << ns << std::endl;
+}
+
+template <typename Clock> inline void basic_lock_stats<Clock>::Print(std::ostream& os) const {
+    PrintMode(os, false, "");
+    PrintMode(os, true, " shared");
+    os << std::flush;
+}
+
+//  an exclusive lock whose wait and hold times are recorded
+template <typename M, typename Clock = std::chrono::steady_clock> class timed_mutex_wrapper {
+public:
+    typedef basic_lock_stats<Clock> stats_type;
+
+    explicit timed_mutex_wrapper(char const* name)
+      : m_stats(&stats_type::Get(name))
+      , m_acquired(0)
+      , m_timed(false)
+    {
+    }
+
+    void lock() {
+        if (m_mutex.try_lock()) {
+            m_timed = m_stats->RecordAcquire(false, false, 0);
+            if (m_timed)
+                m_acquired = clock_ticks<Clock>::now();
+            return;
+        }
+        long long start = clock_ticks<Clock>::now();
+        m_mutex.lock();
+        m_acquired = clock_ticks<Clock>::now();
+        m_timed = m_stats->RecordAcquire(false, true, m_acquired - start);
+    }
+
+    bool try_lock() {
+        if (!m_mutex.try_lock())
+            return false;
+        m_timed = m_stats->RecordAcquire(false, false, 0);
+        if (m_timed)
+            m_acquired = clock_ticks<Clock>::now();
+        return true;
+    }
+
+    void unlock() {
+        if (!m_timed) {
+            m_mutex.unlock();
+            return;
+        }
+        long long hold = clock_ticks<Clock>::now() - m_acquired;
+        m_mutex.unlock();
+        m_stats->RecordHold(false, hold);
+    }
+
+    // the wrapped mutex, locking it directly bypasses the stats
+    M& Native() { return m_mutex; }
+
+    stats_type& Stats() const { return *m_stats; }
+
+private:
+    timed_mutex_wrapper(timed_mutex_wrapper const&);
+    timed_mutex_wrapper& operator=(timed_mutex_wrapper const&);
+
+    M               m_mutex;
+    stats_type*     m_stats;
+    long long       m_acquired;     // written by the holder only
+    bool            m_timed;        // the holder's hold time is sampled
+};
+
+//  the calling thread's shared acquisitions, for their hold times
+struct timed_shared_holds {
+    static unsigned const capacity = 8;
+
+    void const* lock[capacity];
+    long long   acquired[capacity];
+    unsigned    size;
+
+    static timed_shared_holds& Instance() {
+        static thread_local timed_shared_holds holds = { { nullptr }, { 0 }, 0 };
+        return holds;
+    }
+
+    void Push(void const* which, long long ticks) {
+        if (size < capacity) {
+            lock[size] = which;
+            acquired[size++] = ticks;
+        }
+    }
+
+    // ticks at which which was acquired, false if not kept
+    bool Pop(void const* which, long long& ticks) {
+        for (unsigned i = size; i-- > 0; ) {
+            if (lock[i] == which) {
+                ticks = acquired[i];
+                lock[i] = lock[--size];
+                acquired[i] = acquired[size];
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+//  a reader/writer lock whose wait and hold times are recorded per mode
+template <typename M, typename Clock = std::chrono::steady_clock> class timed_shared_mutex_wrapper {
+public:
+    typedef basic_lock_stats<Clock> stats_type;
+
+    explicit timed_shared_mutex_wrapper(char const* name)
+      : m_stats(&stats_type::Get(name))
+      , m_acquired(0)
+      , m_timed(false)
+    {
+    }
+
+    void lock() {
+        if (m_mutex.try_lock()) {
+            m_timed = m_stats->RecordAcquire(false, false, 0);
+            if (m_timed)
+                m_acquired = clock_ticks<Clock>::now();
+            return;
+        }
+        long long start = clock_ticks<Clock>::now();
+        m_mutex.lock();
+        m_acquired = clock_ticks<Clock>::now();
+        m_timed = m_stats->RecordAcquire(false, true, m_acquired - start);
+    }
+
+    bool try_lock() {
+        if (!m_mutex.try_lock())
+            return false;
+        m_timed = m_stats->RecordAcquire(false, false, 0);
+        if (m_timed)
+            m_acquired = clock_ticks<Clock>::now();
+        return true;
+    }
+
+    void unlock() {
+        if (!m_timed) {
+            m_mutex.unlock();
+            return;
+        }
+        long long hold = clock_ticks<Clock>::now() - m_acquired;
+        m_mutex.unlock();
+        m_stats->RecordHold(false, hold);
+    }
+
+    void lock_shared() {
+        if (m_mutex.try_lock_shared()) {
+            if (m_stats->RecordAcquire(true, false, 0))
+                timed_shared_holds::Instance().Push(this, clock_ticks<Clock>::now());
+            return;
+        }
+        long long start = clock_ticks<Clock>::now();
+        m_mutex.lock_shared();
+        long long acquired = clock_ticks<Clock>::now();
+        if (m_stats->RecordAcquire(true, true, acquired - start))
+            timed_shared_holds::Instance().Push(this, acquired);
+    }
+
+    bool try_lock_shared() {
+        if (!m_mutex.try_lock_shared())
+            return false;
+        if (m_stats->RecordAcquire(true, false, 0))
+            timed_shared_holds::Instance().Push(this, clock_ticks<Clock>::now());
+        return true;
+    }
+
+    void unlock_shared() {
+        long long acquired;
+        timed_shared_holds& holds = timed_shared_holds::Instance();
+        bool timed = holds.size && holds.Pop(this, acquired);
+        long long hold = timed ? clock_ticks<Clock>::now() - acquired : 0;
+        m_mutex.unlock_shared();
+        if (timed)
+            m_stats->RecordHold(true, hold);
+    }
+
+    // the wrapped mutex, locking it directly bypasses the stats
+    M& Native() { return m_mutex; }
+
+    stats_type& Stats() const { return *m_stats; }
+
+private:
+    timed_shared_mutex_wrapper(timed_shared_mutex_wrapper const&);
+    timed_shared_mutex_wrapper& operator=(timed_shared_mutex_wrapper const&);
+
+    M               m_mutex;
+    stats_type*     m_stats;
+    long long       m_acquired;     // exclusive holder's acquisition
+    bool            m_timed;        // the exclusive hold is sampled
+};
+
+# endif
@@ -0,0 +1,255 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_PARALLEL_H
+#define PERF_STOPWATCH_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "stopwatchclocksync.h"
+#include "stopwatchformat.h"
+
+/*******************************************************************************
+ *  timed_parallel_for -- a parallel loop that shows its load imbalance
+ *
+ *  Splits [begin, end) into chunks of grain indices, runs fn(lo, hi) for
+ *  every chunk on a set of worker threads that claim chunks one at a time,
+ *  and times every chunk and every worker. The report says how uneven the
+ *  work was: busiest worker against the mean, time workers sat idle waiting
+ *  for the last one at the join, and the straggler chunks.
+ *
+ *      parallel_for_report r = timed_parallel_for(0, rows.size(), 1024,
+ *          [&](size_t lo, size_t hi) { Scan(rows, lo, hi); });
+ *      r.Print(std::cout, "scan");
+ *
+ *  What it prints
+ *      "parallel_for scan: 8 workers, 977 chunks, wall 41203311ns, busy max/mean 1.38, idle at join 61022001ns, stragglers 412 (3011221ns) 413 (2890114ns)"
+ *
+ *  Stragglers are chunks that took more than twice the median chunk, the
+ *  slowest first, at most five.
+ *
+ *  Rebalancing: pass a parallel_for_plan that lives across calls over the
+ *  same range and grain. It keeps the chunk times of the previous call and
+ *  hands out the costliest chunks first, so the expensive ones don't end up
+ *  last on one worker (longest processing time first).
+ *
+ *      static parallel_for_plan plan;
+ *      timed_parallel_for(0, rows.size(), 1024, scan, 0, &plan);
+ *
+ *  threads 0 means std::thread::hardware_concurrency(); the calling thread
+ *  is worker 0, the others are started per call. The workers wait at a
+ *  barrier until all of them run and timing starts there, so starting the
+ *  threads counts neither as idle time nor as imbalance, and wall excludes
+ *  it. Chunks are timed through clock_ticks<Clock>, steady_clock by default.
+ *
+ *  If fn throws, no further chunks are handed out, every worker is joined
+ *  and the first exception is rethrown to the caller; the same goes for a
+ *  worker thread failing to start.
+ *
+ ********************************************************************************/
+
+struct parallel_for_report {
+    unsigned long long                  wall_ns;        // whole loop, start to join
+    std::vector<unsigned long long>     worker_busy_ns; // time in fn per worker
+    std::vector<unsigned long long>     worker_done_ns; // when each worker ran out of chunks
+    std::vector<size_t>                 worker_chunks;  // chunks run per worker
+    std::vector<unsigned long long>     chunk_ns;       // time of each chunk
+    std::vector<unsigned>               chunk_worker;   // worker that ran each chunk
+
+    parallel_for_report() : wall_ns(0) { }
+
+    // busiest worker's time over the mean, 1.0 is perfectly balanced
+    double Imbalance() const {
+        if (worker_busy_ns.empty())
+            return 1.0;
+        unsigned long long max = 0, sum = 0;
+        for (size_t i = 0; i < worker_busy_ns.size(); ++i) {
+            max = std::max(max, worker_busy_ns[i]);
+            sum += worker_busy_ns[i];
+        }
+        return sum ? (double)max * (double)worker_busy_ns.size() / (double)sum : 1.0;
+    }
+
+    // summed time workers waited at the join for the last one
+    unsigned long long IdleAtJoin() const {
+        unsigned long long last = 0, idle = 0;
+        for (size_t i = 0; i < worker_done_ns.size(); ++i)
+            last = std::max(last, worker_done_ns[i]);
+        for (size_t i = 0; i < worker_done_ns.size(); ++i)
+            idle += last - worker_done_ns[i];
+        return idle;
+    }
+
+    // chunks slower than twice the median, slowest first
+    std::vector<size_t> Stragglers(size_t max_count = 5) const {
+        std::vector<size_t> out;
+        if (chunk_ns.empty())
+            return out;
+        std::vector<unsigned long long> sorted(chunk_ns);
+        std::nth_element(sorted.begin(), sorted.begin() + (long)(sorted.size() / 2), sorted.end());
+        unsigned long long median = sorted[sorted.size() / 2];
+        for (size_t i = 0; i < chunk_ns.size(); ++i) {
+            if (chunk_ns[i] > 2 * median)
+                out.push_back(i);
+        }
+        std::sort(out.begin(), out.end(), [this](size_t a, size_t b) { return chunk_ns[a] > chunk_ns[b]; });
+        if (out.size() > max_count)
+            out.resize(max_count);
+        return out;
+    }
+
+    void Print(std::ostream& os, char const* name) const {
+        char imbalance[32];
+        std::snprintf(imbalance, sizeof(imbalance), "%.2f", Imbalance());
+        char const* ns = stopwatch_unit<std::chrono::nanoseconds>::suffix();
+        os << "parallel_for " << name << ": " << worker_busy_ns.size() << " workers, "
+           << chunk_ns.size() << " chunks, wall " << wall_ns << ns << ", busy max/mean " << imbalance
+           << ", idle at join " << IdleAtJoin() << ns << ", stragglers";
+        std::vector<size_t> s = Stragglers();
+        if (s.empty())
+            os << " none";
+        for (size_t i = 0; i < s.size(); ++i)
+            os << " " << s[i] << " (" << chunk_ns[s[i]] << ns << ")";
+        os << std::endl << std::flush;
+    }
+};
+
+//  chunk order for the next call, from the chunk times of the last one
+class parallel_for_plan {
+public:
+    parallel_for_plan() : m_begin(0), m_end(0), m_grain(0) { }
+
+    // the order to hand chunks out in: costliest first if the last call
+    // covered the same chunks, index order otherwise
+    void Order(size_t begin, size_t end, size_t grain, std::vector<size_t>& order) const {
+        size_t chunks = order.size();
+        for (size_t i = 0; i < chunks; ++i)
+            order[i] = i;
+        if (begin != m_begin || end != m_end || grain != m_grain || m_cost.size() != chunks)
+            return;
+        std::vector<unsigned long long> const& cost = m_cost;
+        std::stable_sort(order.begin(), order.end(), [&cost](size_t a, size_t b) { return cost[a] > cost[b]; });
+    }
+
+    // remember the chunk times of a call
+    void Update(size_t begin, size_t end, size_t grain, std::vector<unsigned long long> const& chunk_ns) {
+        m_begin = begin;
+        m_end = end;
+        m_grain = grain;
+        m_cost = chunk_ns;
+    }
+
+private:
+    size_t                              m_begin;
+    size_t                              m_end;
+    size_t                              m_grain;
+    std::vector<unsigned long long>     m_cost;     // nS per chunk, last call
+};
+
+template <typename Clock = std::chrono::steady_clock, typename Fn>
+inline parallel_for_report timed_parallel_for(size_t begin, size_t end, size_t grain, Fn fn,
+                                              unsigned threads = 0, parallel_for_plan* plan = nullptr) {
+    parallel_for_report r;
+    if (grain == 0)
+        grain = 1;
+    size_t chunks = end > begin ? (end - begin + grain - 1) / grain : 0;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if (threads > chunks)
+        threads = chunks ? (unsigned)chunks : 1;
+
+    std::vector<size_t> order(chunks);
+    if (plan)
+        plan->Order(begin, end, grain, order);
+    else
+        for (size_t i = 0; i < chunks; ++i)
+            order[i] = i;
+
+    r.worker_busy_ns.assign(threads, 0);
+    r.worker_done_ns.assign(threads, 0);
+    r.worker_chunks.assign(threads, 0);
+    r.chunk_ns.assign(chunks, 0);
+    r.chunk_worker.assign(chunks, 0);
+
+    static double const ns_per_tick = clock_ticks<Clock>::nominal_ns_per_tick();
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;           // first exception out of fn, under error_mutex
+    std::atomic<unsigned> arrived(0);   // workers waiting at the barrier
+    std::atomic<bool> go(false);        // every worker runs, start is set
+    long long start = 0;
+
+    //  each worker writes only its own slots and the chunks it claimed
+    auto work = [&](unsigned w) {
+        if (w) {
+            arrived.fetch_add(1, std::memory_order_relaxed);
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+        long long busy = 0;
+        size_t k;
+        try {
+            while ((k = next.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+                size_t c = order[k];
+                size_t lo = begin + c * grain;
+                size_t hi = std::min(end, lo + grain);
+                long long t0 = clock_ticks<Clock>::now();
+                fn(lo, hi);
+                long long t1 = clock_ticks<Clock>::now();
+                r.chunk_ns[c] = (unsigned long long)((double)(t1 - t0) * ns_per_tick);
+                r.chunk_worker[c] = w;
+                busy += t1 - t0;
+                ++r.worker_chunks[w];
+            }
+        } catch (...) {
+            next.store(chunks, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+        r.worker_busy_ns[w] = (unsigned long long)((double)busy * ns_per_tick);
+        r.worker_done_ns[w] = (unsigned long long)((double)(clock_ticks<Clock>::now() - start) * ns_per_tick);
+    };
+
+    //  joins whatever was started, also when starting a thread throws
+    struct join_guard {
+        std::vector<std::thread> threads;
+        ~join_guard() {
+            for (size_t i = 0; i < threads.size(); ++i) {
+                if (threads[i].joinable())
+                    threads[i].join();
+            }
+        }
+    } workers;
+    workers.threads.reserve(threads - 1);
+    try {
+        for (unsigned w = 1; w < threads; ++w)
+            workers.threads.push_back(std::thread(work, w));
+    } catch (...) {
+        next.store(chunks, std::memory_order_relaxed);
+        go.store(true, std::memory_order_release);
+        throw;
+    }
+    while (arrived.load(std::memory_order_relaxed) < threads - 1)
+        std::this_thread::yield();
+    start = clock_ticks<Clock>::now();
+    go.store(true, std::memory_order_release);
+    work(0);
+    for (size_t i = 0; i < workers.threads.size(); ++i)
+        workers.threads[i].join();
+    r.wall_ns = (unsigned long long)((double)(clock_ticks<Clock>::now() - start) * ns_per_tick);
+    if (error)
+        std::rethrow_exception(error);
+
+    if (plan)
+        plan->Update(begin, end, grain, r.chunk_ns);
+    return r;
+}
+
+# endif
@@ -0,0 +1,502 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_PERF_H
+#define PERF_STOPWATCH_PERF_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "stopwatch.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*******************************************************************************
+ *  TimerBaseSyscall -- syscalls, their time and context switches per lap
+ *
+ *  Wraps another timer base and counts, on the calling thread, the syscalls
+ *  it entered (tracepoint raw_syscalls:sys_enter) and the context switches
+ *  it went through (software event) between Start() and every lap. Both are
+ *  perf_event_open counters in one group, opened once per thread and read
+ *  with a single read() at each end of the lap; the syscall of that read is
+ *  taken out of the count.
+ *
+ *  The time spent in syscalls comes from sampling every sys_enter and
+ *  sys_exit of the thread into a ring buffer, which the reads at the ends
+ *  of the lap drain, adding up exit minus entry of each syscall. It is wall
+ *  time inside the kernel, so a syscall that blocks (a sleep, a read that
+ *  waits) counts for as long as it blocks. The read at the end of the lap
+ *  is taken out as well, its typical time measured on the thread's first
+ *  use. Two samples per syscall make every syscall of the thread slower by
+ *  a few hundred nS from then on. A lap with more syscalls than the ring
+ *  holds (about 5000) loses samples; its time is then a lower bound and
+ *  SyscallTimeLost() says so.
+ *
+ *      typedef basic_stopwatch< TimerBaseSyscall< TimerBaseChrono<
+ *          std::chrono::steady_clock, std::chrono::microseconds> > > SyscallStopwatch;
+ *
+ *      SyscallStopwatch sw("loop");
+ *      ...
+ *      sw.Stop();
+ *      std::cout << "loop: " << sw.Syscalls() << " syscalls in " << sw.SyscallNs() << "ns, "
+ *                << sw.ContextSwitches() << " context switches" << std::endl;
+ *
+ *  The syscall tracepoints need tracefs and, with perf_event_paranoid above
+ *  -1, CAP_PERFMON; context switches only need perf_event_paranoid <= 2.
+ *  A counter that can't be opened reads 0 and SyscallsAvailable(),
+ *  SyscallTimeAvailable() or ContextSwitchesAvailable() says so. Off Linux
+ *  none is available.
+ *
+ *  perf_counter_group is the building block: any set of perf events, opened
+ *  on the calling thread as one group and read together.
+ *
+ ********************************************************************************/
+
+class perf_counter_group {
+public:
+    static unsigned const max_events = 8;
+
+    perf_counter_group();
+    ~perf_counter_group();
+
+    // add an event (perf_event_attr type and config) before Open(), false
+    // if the group is full. Returns through index the slot to read it from
+    bool Add(unsigned type, unsigned long long config, unsigned* index = nullptr);
+
+    // open the events on the calling thread and start counting. Events the
+    // kernel refuses are left out; false if none could be opened
+    bool Open();
+
+    // number of events added
+    unsigned Size() const { return m_size; }
+
+    // true if event i is counting
+    bool Available(unsigned i) const { return i < m_size && m_slot[i] >= 0; }
+
+    // read every event with one read(), unavailable ones as 0. values holds
+    // Size() counters. When the kernel multiplexed the group, values are
+    // scaled to the full time enabled
+    bool Read(unsigned long long* values) const;
+
+    // id of a tracepoint ("raw_syscalls/sys_enter"), -1 if not found
+    static long TracepointId(char const* name);
+
+private:
+    perf_counter_group(perf_counter_group const&);
+    perf_counter_group& operator=(perf_counter_group const&);
+
+    unsigned            m_size;
+    unsigned            m_open;                 // events in the group
+    int                 m_leader;               // group fd, -1 if closed
+    unsigned            m_type[max_events];
+    unsigned long long  m_config[max_events];
+    int                 m_fd[max_events];
+    int                 m_slot[max_events];     // position in the group read, -1 if unavailable
+};
+
+inline perf_counter_group::perf_counter_group()
+  : m_size(0)
+  , m_open(0)
+  , m_leader(-1)
+{
+}
+
+inline perf_counter_group::~perf_counter_group() {
+#if defined(__linux__)
+    for (unsigned i = 0; i < m_size; ++i) {
+        if (m_slot[i] >= 0)
+            close(m_fd[i]);
+    }
+#endif
+}
+
+inline bool perf_counter_group::Add(unsigned type, unsigned long long config, unsigned* index) {
+    if (m_size == max_events || m_leader >= 0)
+        return false;
+    m_type[m_size] = type;
+    m_config[m_size] = config;
+    m_fd[m_size] = -1;
+    m_slot[m_size] = -1;
+    if (index)
+        *index = m_size;
+    ++m_size;
+    return true;
+}
+
+inline bool perf_counter_group::Open() {
+#if defined(__linux__)
+    for (unsigned i = 0; i < m_size; ++i) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = m_type[i];
+        attr.config = m_config[i];
+        attr.disabled = m_leader < 0;           // the leader starts the group
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && m_type[i] == PERF_TYPE_HARDWARE) {
+            attr.exclude_kernel = 1;            // perf_event_paranoid 2
+            fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (fd < 0)
+            continue;
+        m_fd[i] = fd;
+        m_slot[i] = (int)m_open++;
+        if (m_leader < 0)
+            m_leader = fd;
+    }
+    if (m_leader < 0)
+        return false;
+    ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline bool perf_counter_group::Read(unsigned long long* values) const {
+    for (unsigned i = 0; i < m_size; ++i)
+        values[i] = 0;
+#if defined(__linux__)
+    if (m_leader < 0)
+        return false;
+    // nr, time enabled, time running, one value per open event
+    unsigned long long buf[3 + max_events];
+    ssize_t n = read(m_leader, buf, sizeof(buf));
+    if (n < (ssize_t)(3 * sizeof(buf[0])) || buf[0] != m_open)
+        return false;
+    double scale = buf[2] && buf[2] < buf[1] ? (double)buf[1] / (double)buf[2] : 1.0;
+    for (unsigned i = 0; i < m_size; ++i) {
+        if (m_slot[i] >= 0)
+            values[i] = scale == 1.0 ? buf[3 + m_slot[i]]
+                                     : (unsigned long long)((double)buf[3 + m_slot[i]] * scale);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline long perf_counter_group::TracepointId(char const* name) {
+    static char const* const roots[] = { "/sys/kernel/tracing/events/", "/sys/kernel/debug/tracing/events/" };
+    for (unsigned i = 0; i < sizeof(roots) / sizeof(roots[0]); ++i) {
+        char path[256];
+        std::snprintf(path, sizeof(path), "%s%s/id", roots[i], name);
+        FILE* f = std::fopen(path, "r");
+        if (!f)
+            continue;
+        long id = -1;
+        if (std::fscanf(f, "%ld", &id) != 1)
+            id = -1;
+        std::fclose(f);
+        if (id >= 0)
+            return id;
+    }
+    return -1;
+}
+
+//  the calling thread's syscall and context switch counters, and the time
+//  of its syscalls from the samples of the sys_enter and sys_exit tracepoints
+class perf_syscall_counters {
+public:
+    static unsigned const ring_pages = 64;      // of sample data, a power of 2
+
+    // what a Read() saw, totals since the counters were opened
+    struct totals {
+        unsigned long long  syscalls;
+        unsigned long long  switches;
+        unsigned long long  syscall_ns;         // time inside syscalls
+        unsigned long long  lost;               // reads that found the ring full
+    };
+
+    perf_syscall_counters();
+    ~perf_syscall_counters();
+
+    static perf_syscall_counters& Instance() {
+        static thread_local perf_syscall_counters counters;
+        return counters;
+    }
+
+    // read the counters and drain the samples, false if nothing is available
+    bool Read(totals& t);
+
+    bool SyscallsAvailable() const { return m_group.Available(m_syscalls); }
+    bool SyscallTimeAvailable() const { return m_ring != nullptr; }
+    bool ContextSwitchesAvailable() const { return m_group.Available(m_switches); }
+
+    // syscalls a Read() at the end of a lap adds to it, and their nS
+    unsigned long long ReadSyscalls() const { return m_read_syscalls; }
+    unsigned long long ReadSyscallNs() const { return m_read_ns; }
+
+private:
+    perf_syscall_counters(perf_syscall_counters const&);
+    perf_syscall_counters& operator=(perf_syscall_counters const&);
+
+    // open a tracepoint sampling every hit with its time, -1 on failure
+    static int OpenSampler(long id, unsigned long long& sample_id);
+
+    // add the syscalls whose samples are in the ring to m_syscall_ns
+    void Drain();
+
+    perf_counter_group  m_group;
+    unsigned            m_syscalls;         // event index, max_events if not added
+    unsigned            m_switches;
+    unsigned long long  m_read_syscalls;
+    int                 m_enter_fd;         // the ring is mapped on it, -1 if none
+    int                 m_exit_fd;
+    unsigned long long  m_enter_id;         // sample ids of the two tracepoints
+    unsigned long long  m_exit_id;
+    void*               m_ring;             // control page and sample data, null if none
+    size_t              m_ring_bytes;
+    long long           m_entered;          // time of an entry without its exit yet, -1 if none
+    unsigned long long  m_syscall_ns;
+    unsigned long long  m_lost;
+    unsigned long long  m_read_ns;
+};
+
+inline perf_syscall_counters::perf_syscall_counters()
+  : m_syscalls(perf_counter_group::max_events)
+  , m_switches(perf_counter_group::max_events)
+  , m_read_syscalls(0)
+  , m_enter_fd(-1)
+  , m_exit_fd(-1)
+  , m_enter_id(0)
+  , m_exit_id(0)
+  , m_ring(nullptr)
+  , m_ring_bytes(0)
+  , m_entered(-1)
+  , m_syscall_ns(0)
+  , m_lost(0)
+  , m_read_ns(0)
+{
+#if defined(__linux__)
+    long id = perf_counter_group::TracepointId("raw_syscalls/sys_enter");
+    if (id >= 0)
+        m_group.Add(PERF_TYPE_TRACEPOINT, (unsigned long long)id, &m_syscalls);
+    m_group.Add(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, &m_switches);
+    m_group.Open();
+
+    long exit_id = perf_counter_group::TracepointId("raw_syscalls/sys_exit");
+    if (id >= 0 && exit_id >= 0) {
+        m_enter_fd = OpenSampler(id, m_enter_id);
+        m_exit_fd = m_enter_fd >= 0 ? OpenSampler(exit_id, m_exit_id) : -1;
+        m_ring_bytes = (size_t)(ring_pages + 1) * (size_t)sysconf(_SC_PAGESIZE);
+        void* ring = m_exit_fd >= 0 ? mmap(nullptr, m_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_enter_fd, 0)
+                                    : MAP_FAILED;
+        if (ring != MAP_FAILED && ioctl(m_exit_fd, PERF_EVENT_IOC_SET_OUTPUT, m_enter_fd) == 0) {
+            m_ring = ring;
+            ioctl(m_enter_fd, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(m_exit_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        else if (ring != MAP_FAILED)
+            munmap(ring, m_ring_bytes);
+    }
+
+    // what one Read() adds to a lap, the least of a few
+    totals a, b;
+    for (int i = 0; i < 8 && (SyscallsAvailable() || SyscallTimeAvailable()); ++i) {
+        Read(a);
+        Read(b);
+        unsigned long long n = b.syscalls - a.syscalls;
+        unsigned long long ns = b.syscall_ns - a.syscall_ns;
+        if (i == 0 || n < m_read_syscalls)
+            m_read_syscalls = n;
+        if (i == 0 || ns < m_read_ns)
+            m_read_ns = ns;
+    }
+#endif
+}
+
+inline perf_syscall_counters::~perf_syscall_counters() {
+#if defined(__linux__)
+    if (m_ring)
+        munmap(m_ring, m_ring_bytes);
+    if (m_exit_fd >= 0)
+        close(m_exit_fd);
+    if (m_enter_fd >= 0)
+        close(m_enter_fd);
+#endif
+}
+
+inline int perf_syscall_counters::OpenSampler(long id, unsigned long long& sample_id) {
+#if defined(__linux__)
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = (unsigned long long)id;
+    attr.sample_period = 1;
+    attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TIME;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ioctl(fd, PERF_EVENT_IOC_ID, &sample_id) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)id;
+    (void)sample_id;
+    return -1;
+#endif
+}
+
+//  the ring holds records of a header and, for samples, the id and the
+//  time. The kernel writes head, we write tail; a record may wrap around.
+//  A ring too full for another sample has lost some; the kernel's own note
+//  of it comes with a later sample, too late to mark the lap
+inline void perf_syscall_counters::Drain() {
+#if defined(__linux__)
+    if (!m_ring)
+        return;
+    perf_event_mmap_page* meta = (perf_event_mmap_page*)m_ring;
+    unsigned char const* data = (unsigned char const*)m_ring + meta->data_offset;
+    unsigned long long size = meta->data_size;
+    if (!size) {                                // kernels before 4.1
+        data = (unsigned char const*)m_ring + sysconf(_SC_PAGESIZE);
+        size = (unsigned long long)ring_pages * (unsigned long long)sysconf(_SC_PAGESIZE);
+    }
+    unsigned long long head = *(volatile __u64*)&meta->data_head;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    unsigned long long tail = meta->data_tail;
+    unsigned char record[64];
+    bool full = head - tail + sizeof(record) > size;
+    while (tail < head) {
+        perf_event_header h;
+        for (size_t i = 0; i < sizeof(h); ++i)
+            record[i] = data[(tail + i) & (size - 1)];
+        std::memcpy(&h, record, sizeof(h));
+        if (h.size < sizeof(h) || tail + h.size > head)
+            break;
+        size_t n = h.size < sizeof(record) ? h.size : sizeof(record);
+        for (size_t i = sizeof(h); i < n; ++i)
+            record[i] = data[(tail + i) & (size - 1)];
+        if (h.type == PERF_RECORD_SAMPLE && n >= sizeof(h) + 16) {
+            unsigned long long id, time;
+            std::memcpy(&id, record + sizeof(h), 8);
+            std::memcpy(&time, record + sizeof(h) + 8, 8);
+            if (id == m_enter_id)
+                m_entered = (long long)time;
+            else if (id == m_exit_id && m_entered >= 0) {
+                if ((long long)time > m_entered)
+                    m_syscall_ns += (unsigned long long)((long long)time - m_entered);
+                m_entered = -1;
+            }
+        }
+        else if (h.type == PERF_RECORD_LOST)
+            m_entered = -1;
+        tail += h.size;
+    }
+    if (full) {
+        ++m_lost;
+        m_entered = -1;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    meta->data_tail = tail;
+#endif
+}
+
+//  drained after the counters are read, so that a lap holds the time of
+//  the read that ends it, as its count does, and the kernel's note of
+//  samples it had no room for, which it writes with the next sample
+inline bool perf_syscall_counters::Read(totals& t) {
+    unsigned long long v[perf_counter_group::max_events];
+    bool ok = m_group.Read(v);
+    Drain();
+    t.syscalls = SyscallsAvailable() ? v[m_syscalls] : 0;
+    t.switches = ContextSwitchesAvailable() ? v[m_switches] : 0;
+    t.syscall_ns = m_syscall_ns;
+    t.lost = m_lost;
+    return ok || SyscallTimeAvailable();
+}
+
+template <typename Base>
+class TimerBaseSyscall : public Base {
+
+public:
+        typedef typename Base::duration duration;
+
+        TimerBaseSyscall() : m_ok(false), m_syscalls(0), m_syscall_ns(0), m_switches(0), m_lost(false) {
+                std::memset(&m_start, 0, sizeof(m_start));
+        }
+
+        //      start the timer and snapshot the counters
+        void Start() {
+                m_ok = perf_syscall_counters::Instance().Read(m_start);
+                m_syscalls = m_syscall_ns = m_switches = 0;
+                m_lost = false;
+                Base::Start();
+        }
+
+        //      get the lap, and the counters since Start()
+        unsigned long GetMs() {
+                unsigned long lap = Base::GetMs();
+                perf_syscall_counters& c = perf_syscall_counters::Instance();
+                perf_syscall_counters::totals now;
+                if (m_ok && Base::IsStarted() && c.Read(now)) {
+                        m_syscalls = Less(now.syscalls - m_start.syscalls, c.ReadSyscalls());
+                        m_syscall_ns = Less(now.syscall_ns - m_start.syscall_ns, c.ReadSyscallNs());
+                        m_switches = now.switches - m_start.switches;
+                        m_lost = now.lost != m_start.lost;
+                }
+                return lap;
+        }
+
+        //      syscalls entered during the last lap
+        unsigned long long Syscalls() const {
+                return m_syscalls;
+        }
+
+        //      nS spent inside syscalls during the last lap, blocking included
+        unsigned long long SyscallNs() const {
+                return m_syscall_ns;
+        }
+
+        //      true if samples were lost in the last lap, SyscallNs() is low
+        bool SyscallTimeLost() const {
+                return m_lost;
+        }
+
+        //      context switches during the last lap
+        unsigned long long ContextSwitches() const {
+                return m_switches;
+        }
+
+        //      true if the calling thread's counters can be read
+        bool SyscallsAvailable() const {
+                return perf_syscall_counters::Instance().SyscallsAvailable();
+        }
+
+        bool SyscallTimeAvailable() const {
+                return perf_syscall_counters::Instance().SyscallTimeAvailable();
+        }
+
+        bool ContextSwitchesAvailable() const {
+                return perf_syscall_counters::Instance().ContextSwitchesAvailable();
+        }
+private:
+        static unsigned long long Less(unsigned long long v, unsigned long long d) {
+                return v > d ? v - d : 0;
+        }
+
+        bool                            m_ok;           // counters read at Start()
+        perf_syscall_counters::totals   m_start;
+        unsigned long long              m_syscalls;     // from Start() to the last lap
+        unsigned long long              m_syscall_ns;
+        unsigned long long              m_switches;
+        bool                            m_lost;
+};
+
+# endif
@@ -0,0 +1,548 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_PROFILER_H
+#define PERF_STOPWATCH_PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+/*******************************************************************************
+ *  class stopwatch_profiler -- statistical CPU breakdown per logical scope
+ *
+ *  Scopes too hot for a stopwatch get a marker instead: STOPWATCH_PROFILE_SCOPE
+ *  pushes its name on a thread local stack and pops it at the end of the
+ *  block, two stores and a relaxed load. While a profiler runs, every
+ *  sampled thread gets a timer on its own CPU time that raises SIGPROF at
+ *  the sampling rate; the handler copies the thread's scope stack, and
+ *  optionally a frame pointer backtrace, into a preallocated buffer. The
+ *  overhead depends on the sampling rate, not on how often scopes run.
+ *
+ *      void Parse() {
+ *          STOPWATCH_PROFILE_SCOPE("net.parse");
+ *          ...
+ *      }
+ *
+ *      {
+ *          stopwatch_profiler prof(997);           // samples per CPU second, 10s
+ *          Serve();
+ *          prof.Stop();
+ *          prof.Report();
+ *      }
+ *
+ *  What it reports, one line per scope stack, root first
+ *      "profile: 4012 samples at 997 Hz, 0 dropped"
+ *      "profile: net.request;net.parse 1650 41.1%"
+ *      "profile: net.request 1204 30.0%"
+ *      "profile: (no scope) 1158 28.9%"
+ *
+ *  WriteCollapsed() writes "scope;scope;function;function count" lines for
+ *  flame graph tools; with backtraces on, the functions are the sampled
+ *  frames, symbolized with dladdr().
+ *
+ *  The sample buffer is sized for the expected run, hz times duration times
+ *  threads (the hardware threads by default); samples beyond that count as
+ *  dropped. Backtrace room is only allocated with backtraces on. Stop()
+ *  waits for signal handlers still running on other threads before it
+ *  returns, so the buffer can be freed after it.
+ *
+ *  A thread is sampled once it has entered a scope (or called Attach())
+ *  since the profiler started. Backtraces need frame pointers
+ *  (-fno-omit-frame-pointer) and stop at the first frame outside the
+ *  thread's stack. One profiler runs at a time; it owns SIGPROF while it
+ *  runs. Linux only, elsewhere the markers still compile and nothing is
+ *  sampled.
+ *
+ ********************************************************************************/
+
+//  a thread's stack of profile scopes, read by the signal handler
+struct stopwatch_profile_stack {
+    static unsigned const max_depth = 16;
+
+    char const*         scope[max_depth];
+    volatile unsigned   depth;              // may exceed max_depth, deeper scopes aren't kept
+    unsigned            generation;         // profiler run the thread is attached to, 0 none
+#if defined(__linux__)
+    timer_t             timer;
+    bool                has_timer;
+    uintptr_t           stack_low;          // bounds for the backtrace walk
+    uintptr_t           stack_high;
+#endif
+
+    stopwatch_profile_stack();
+    ~stopwatch_profile_stack();
+
+    // attach to or detach from the current profiler run
+    void Attach(unsigned run);
+};
+
+inline stopwatch_profile_stack& stopwatch_profile_thread() {
+    static thread_local stopwatch_profile_stack stack;
+    return stack;
+}
+
+class stopwatch_profiler {
+public:
+    static unsigned const max_frames = 16;
+
+    // start sampling hz times per second of each thread's CPU time, with
+    // room for about duration of threads busy threads, 0 the hardware threads
+    explicit stopwatch_profiler(unsigned hz = 997, bool backtrace = false,
+                                std::chrono::milliseconds duration = std::chrono::seconds(10),
+                                unsigned threads = 0);
+
+    // stop sampling
+    ~stopwatch_profiler();
+
+    // false if another profiler was running at construction
+    bool IsRunning() const { return m_run != 0 && State().run.load(std::memory_order_relaxed) == m_run; }
+
+    // stop sampling, the samples stay for Report()
+    void Stop();
+
+    // samples taken, a signal that stood for several timer expirations
+    // counts as that many
+    unsigned long long Samples() const;
+
+    // samples lost to a full buffer
+    unsigned long long Dropped() const;
+
+    // share of the samples per scope stack, most sampled first
+    void Report(std::ostream& os = std::cout) const;
+
+    // collapsed stacks for flame graph tools
+    void WriteCollapsed(std::ostream& os) const;
+
+    // sample the calling thread too, without entering a scope
+    static void Attach();
+
+    // the current profiler run, 0 if none. Used by the scope markers
+    static unsigned Run() { return State().run.load(std::memory_order_relaxed); }
+
+private:
+    friend struct stopwatch_profile_stack;
+
+    //  frames of sample i are at frame[i * max_frames], with backtraces on
+    struct sample {
+        std::atomic<bool>   ready;
+        unsigned            depth;
+        unsigned            frames;
+        unsigned            weight;         // timer expirations, 1 plus overruns
+        char const*         scope[stopwatch_profile_stack::max_depth];
+    };
+
+#if defined(__linux__)
+    //  a timer of the current run and the thread it samples. Matched by
+    //  thread, the kernel hands out the ids of deleted timers again
+    struct thread_timer {
+        timer_t                         id;
+        stopwatch_profile_stack const*  owner;
+    };
+#endif
+
+    //  what the signal handler needs, shared by all profiler runs
+    struct state {
+        std::atomic<unsigned>           run;            // current run, 0 if none
+        std::atomic<unsigned>           active;         // handlers running now
+        unsigned                        last_run;
+        sample*                         samples;
+        void**                          frames;
+        size_t                          capacity;
+        std::atomic<size_t>             next;
+        std::atomic<unsigned long long> dropped;
+        long                            interval_ns;
+        std::mutex                      mutex;          // guards timers
+#if defined(__linux__)
+        std::vector<thread_timer>       timers;         // of the current run only
+        struct sigaction                previous;
+#endif
+
+        state() : run(0), active(0), last_run(0), samples(nullptr), frames(nullptr), capacity(0), next(0), dropped(0)
+                , interval_ns(0) { }
+    };
+
+    stopwatch_profiler(stopwatch_profiler const&);
+    stopwatch_profiler& operator=(stopwatch_profiler const&);
+
+    static state& State() {
+        static state s;
+        return s;
+    }
+
+#if defined(__linux__)
+    static void Handler(int, siginfo_t*, void* context);
+#endif
+
+    // the scope path of sample i, root first, and its frames outermost first
+    std::string Path(sample const& s) const;
+    std::string Frames(size_t i) const;
+
+    unsigned    m_run;              // this profiler's run, 0 if it never ran
+    unsigned    m_hz;
+    sample*     m_samples;
+    void**      m_frames;           // null without backtraces
+    size_t      m_capacity;
+};
+
+inline stopwatch_profile_stack::stopwatch_profile_stack()
+  : depth(0)
+  , generation(0)
+#if defined(__linux__)
+  , has_timer(false)
+  , stack_low(0)
+  , stack_high(0)
+#endif
+{
+}
+
+inline stopwatch_profile_stack::~stopwatch_profile_stack() {
+    Attach(0);
+}
+
+inline void stopwatch_profile_stack::Attach(unsigned run) {
+#if defined(__linux__)
+    stopwatch_profiler::state& s = stopwatch_profiler::State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (has_timer) {
+        // the profiler deletes its timers when it stops, delete ours only
+        // if it is still on its list
+        for (size_t i = 0; i < s.timers.size(); ++i) {
+            if (s.timers[i].owner == this) {
+                timer_delete(timer);
+                s.timers.erase(s.timers.begin() + (long)i);
+                break;
+            }
+        }
+        has_timer = false;
+    }
+    generation = run;
+    if (!run || s.run.load(std::memory_order_relaxed) != run)
+        return;
+    if (!stack_high) {
+        pthread_attr_t attr;
+        void* low;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &low, &size) == 0) {
+                stack_low = (uintptr_t)low;
+                stack_high = (uintptr_t)low + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    sigevent ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SIGPROF;
+#if defined(sigev_notify_thread_id)
+    ev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+#else
+    ev._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+#endif
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &timer) != 0)
+        return;
+    itimerspec spec;
+    spec.it_interval.tv_sec = s.interval_ns / 1000000000L;
+    spec.it_interval.tv_nsec = s.interval_ns % 1000000000L;
+    spec.it_value = spec.it_interval;
+    timer_settime(timer, 0, &spec, nullptr);
+    stopwatch_profiler::thread_timer t = { timer, this };
+    s.timers.push_back(t);
+    has_timer = true;
+#else
+    generation = run;
+#endif
+}
+
+//  marks a block as a profile scope
+class stopwatch_profile_scope {
+public:
+    explicit stopwatch_profile_scope(char const* name) {
+        stopwatch_profile_stack& t = stopwatch_profile_thread();
+        unsigned run = stopwatch_profiler::Run();
+        if (t.generation != run)
+            t.Attach(run);
+        unsigned d = t.depth;
+        if (d < stopwatch_profile_stack::max_depth)
+            t.scope[d] = name;
+        std::atomic_signal_fence(std::memory_order_release);
+        t.depth = d + 1;
+    }
+
+    ~stopwatch_profile_scope() {
+        stopwatch_profile_stack& t = stopwatch_profile_thread();
+        t.depth = t.depth - 1;
+    }
+
+private:
+    stopwatch_profile_scope(stopwatch_profile_scope const&);
+    stopwatch_profile_scope& operator=(stopwatch_profile_scope const&);
+};
+
+#define STOPWATCH_PROFILE_CONCAT(a, b) STOPWATCH_PROFILE_CONCAT_I(a, b)
+#define STOPWATCH_PROFILE_CONCAT_I(a, b) a##b
+
+//  unique per use, so that two scopes on one line (from a macro) don't clash
+#if defined(__COUNTER__)
+#define STOPWATCH_PROFILE_ID __COUNTER__
+#else
+#define STOPWATCH_PROFILE_ID __LINE__
+#endif
+
+//  mark the rest of the block as profile scope "name", a string literal
+#define STOPWATCH_PROFILE_SCOPE(name) \
+    stopwatch_profile_scope STOPWATCH_PROFILE_CONCAT(stopwatch_profile_, STOPWATCH_PROFILE_ID)(name)
+
+inline stopwatch_profiler::stopwatch_profiler(unsigned hz, bool backtrace, std::chrono::milliseconds duration, unsigned threads)
+  : m_run(0)
+  , m_hz(hz ? hz : 1)
+  , m_samples(nullptr)
+  , m_frames(nullptr)
+  , m_capacity(0)
+{
+#if defined(__linux__)
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    double ms = duration.count() > 0 ? (double)duration.count() : 1.0;
+    m_capacity = (size_t)((double)m_hz * ms / 1000.0 * (double)threads) + 1;
+    state& s = State();
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.run.load(std::memory_order_relaxed))
+            return;
+        m_samples = new sample[m_capacity];
+        for (size_t i = 0; i < m_capacity; ++i)
+            m_samples[i].ready.store(false, std::memory_order_relaxed);
+        if (backtrace)
+            m_frames = new void*[m_capacity * max_frames];
+        s.samples = m_samples;
+        s.frames = m_frames;
+        s.capacity = m_capacity;
+        s.next.store(0, std::memory_order_relaxed);
+        s.dropped.store(0, std::memory_order_relaxed);
+        s.interval_ns = 1000000000L / (long)m_hz;
+        if (++s.last_run == 0)
+            ++s.last_run;
+        m_run = s.last_run;
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = &stopwatch_profiler::Handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, &s.previous);
+        s.run.store(m_run, std::memory_order_release);
+    }
+    Attach();
+#else
+    (void)backtrace;
+    (void)duration;
+    (void)threads;
+#endif
+}
+
+//  Stop() has waited for the handlers, none can write the buffers anymore
+inline stopwatch_profiler::~stopwatch_profiler() {
+    Stop();
+    delete[] m_samples;
+    delete[] m_frames;
+}
+
+inline void stopwatch_profiler::Stop() {
+#if defined(__linux__)
+    state& s = State();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!m_run || s.run.load(std::memory_order_relaxed) != m_run)
+        return;
+    s.run.store(0, std::memory_order_release);
+    for (size_t i = 0; i < s.timers.size(); ++i)
+        timer_delete(s.timers[i].id);
+    s.timers.clear();
+    // a SIGPROF still pending would kill the process under SIG_DFL
+    if (s.previous.sa_handler == SIG_DFL && !(s.previous.sa_flags & SA_SIGINFO))
+        s.previous.sa_handler = SIG_IGN;
+    sigaction(SIGPROF, &s.previous, nullptr);
+    // a handler that started before this saw run 0 or is counted in active
+    while (s.active.load())
+        std::this_thread::yield();
+    s.samples = nullptr;
+    s.frames = nullptr;
+    s.capacity = 0;
+#endif
+}
+
+inline void stopwatch_profiler::Attach() {
+    unsigned run = Run();
+    stopwatch_profile_stack& t = stopwatch_profile_thread();
+    if (t.generation != run)
+        t.Attach(run);
+}
+
+#if defined(__linux__)
+inline void stopwatch_profiler::Handler(int, siginfo_t* info, void* context) {
+    int saved = errno;
+    state& s = State();
+    // counted before run is checked, so Stop() either makes this return or
+    // waits for it
+    s.active.fetch_add(1);
+    if (!s.run.load()) {
+        s.active.fetch_sub(1);
+        errno = saved;
+        return;
+    }
+    size_t i = s.next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= s.capacity) {
+        s.dropped.fetch_add(1, std::memory_order_relaxed);
+        s.active.fetch_sub(1);
+        errno = saved;
+        return;
+    }
+    sample& out = s.samples[i];
+    // the kernel checks CPU timers on ticks, expirations between two
+    // signals show up as overruns
+    out.weight = 1 + (info->si_code == SI_TIMER && info->si_overrun > 0 ? (unsigned)info->si_overrun : 0);
+    stopwatch_profile_stack& t = stopwatch_profile_thread();
+    unsigned depth = t.depth;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    out.depth = depth < stopwatch_profile_stack::max_depth ? depth : stopwatch_profile_stack::max_depth;
+    for (unsigned d = 0; d < out.depth; ++d)
+        out.scope[d] = t.scope[d];
+
+    out.frames = 0;
+    uintptr_t pc = 0, fp = 0;
+    ucontext_t* uc = (ucontext_t*)context;
+#if defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#else
+    (void)uc;
+#endif
+    void** frame = s.frames ? s.frames + i * max_frames : nullptr;
+    if (frame && pc) {
+        frame[out.frames++] = (void*)pc;
+        //  each frame holds the caller's frame pointer, then the return address
+        while (out.frames < max_frames && fp >= t.stack_low && fp + 2 * sizeof(uintptr_t) <= t.stack_high
+               && !(fp & (sizeof(uintptr_t) - 1))) {
+            uintptr_t const* caller = (uintptr_t const*)fp;
+            if (!caller[1])
+                break;
+            frame[out.frames++] = (void*)caller[1];
+            if (caller[0] <= fp)
+                break;
+            fp = caller[0];
+        }
+    }
+    out.ready.store(true, std::memory_order_release);
+    s.active.fetch_sub(1);
+    errno = saved;
+}
+#endif
+
+inline unsigned long long stopwatch_profiler::Samples() const {
+    unsigned long long n = 0;
+    for (size_t i = 0; m_samples && i < m_capacity; ++i)
+        n += m_samples[i].ready.load(std::memory_order_acquire) ? m_samples[i].weight : 0;
+    return n;
+}
+
+inline unsigned long long stopwatch_profiler::Dropped() const {
+    return m_run ? State().dropped.load(std::memory_order_relaxed) : 0;
+}
+
+inline std::string stopwatch_profiler::Path(sample const& s) const {
+    if (!s.depth)
+        return "(no scope)";
+    std::string path;
+    for (unsigned d = 0; d < s.depth; ++d) {
+        if (d)
+            path += ';';
+        path += s.scope[d];
+    }
+    return path;
+}
+
+inline std::string stopwatch_profiler::Frames(size_t i) const {
+    std::string out;
+    if (!m_frames)
+        return out;
+    void* const* frame = m_frames + i * max_frames;
+    for (unsigned f = m_samples[i].frames; f-- > 0; ) {
+        out += ';';
+        char buf[32];
+        char const* name = nullptr;
+#if defined(__linux__)
+        Dl_info info;
+        // a return address points past the call, look up the call itself
+        void* addr = f ? (void*)((char*)frame[f] - 1) : frame[f];
+        if (dladdr(addr, &info) && info.dli_sname)
+            name = info.dli_sname;
+#endif
+        if (!name) {
+            std::snprintf(buf, sizeof(buf), "%p", frame[f]);
+            name = buf;
+        }
+        out += name;
+    }
+    return out;
+}
+
+inline void stopwatch_profiler::Report(std::ostream& os) const {
+    std::map<std::string, unsigned long long> counts;
+    unsigned long long total = 0;
+    for (size_t i = 0; m_samples && i < m_capacity; ++i) {
+        if (!m_samples[i].ready.load(std::memory_order_acquire))
+            continue;
+        counts[Path(m_samples[i])] += m_samples[i].weight;
+        total += m_samples[i].weight;
+    }
+    os << "profile: " << total << " samples at " << m_hz << " Hz, " << Dropped() << " dropped" << std::endl;
+    std::vector<std::pair<unsigned long long, std::string> > sorted;
+    for (std::map<std::string, unsigned long long>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+        sorted.push_back(std::make_pair(it->second, it->first));
+    std::sort(sorted.begin(), sorted.end(), [](std::pair<unsigned long long, std::string> const& a,
+                                               std::pair<unsigned long long, std::string> const& b) {
+        return a.first > b.first;
+    });
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        char pct[32];
+        std::snprintf(pct, sizeof(pct), "%.1f%%", 100.0 * (double)sorted[i].first / (double)total);
+        os << "profile: " << sorted[i].second << " " << sorted[i].first << " " << pct << std::endl;
+    }
+    os << std::flush;
+}
+
+inline void stopwatch_profiler::WriteCollapsed(std::ostream& os) const {
+    std::map<std::string, unsigned long long> counts;
+    for (size_t i = 0; m_samples && i < m_capacity; ++i) {
+        if (m_samples[i].ready.load(std::memory_order_acquire))
+            counts[Path(m_samples[i]) + Frames(i)] += m_samples[i].weight;
+    }
+    for (std::map<std::string, unsigned long long>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+        os << it->first << " " << it->second << "\n";
+    os << std::flush;
+}
+
+# endif
@@ -0,0 +1,315 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_REGISTRY_H
+#define PERF_STOPWATCH_REGISTRY_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "stopwatchgauge.h"
+#include "stopwatchsite.h"
+
+/*******************************************************************************
+ *  class stopwatch_registry -- named stopwatch call sites, switchable at runtime
+ *
+ *  Every call site registered through STOPWATCH_SITE() gets one
+ *  stopwatch_site, shared by all call sites with the same activity name. A
+ *  stopwatch constructed from a disabled site doesn't read the clock or print
+ *  anything; the check is one relaxed atomic load and a branch, two loads for
+ *  a site the governor switched off. An enabled site adds a lookup of its
+ *  per thread counters and a load of its sample rate, and while a governor
+ *  runs, a load of the governed flag and a countdown to the next scope
+ *  measured for cost.
+ *
+ *      void Parse() {
+ *          Stopwatchmicro sw(STOPWATCH_SITE("net.parse"));
+ *          ...
+ *      }
+ *
+ *  Sites are switched by rules, applied in order with the last match winning.
+ *  A rule is a glob pattern (* and ?) with an optional + (enable) or -
+ *  (disable) prefix; a rule list is separated by commas, spaces or newlines.
+ *  Rules come from
+ *      the API                 stopwatch_registry::Instance().Enable("net.*", true)
+ *                              stopwatch_registry::Instance().Configure("-*,+net.*")
+ *      the environment         STOPWATCH_ENABLE="-*,+net.*" read at first use
+ *      a control file          Instance().Watch("/run/myapp/stopwatch")
+ *                              reread by a background thread when it changes
+ *
+ *  Sites matched by no rule are enabled. Enabling or disabling takes effect
+ *  for stopwatches constructed afterwards; a running stopwatch finishes its
+ *  lap.
+ *
+ *  A site can also run only 1 in 2^sample_shift of its stopwatches; the
+ *  overhead governor (stopwatchgovernor.h) uses that to throttle sites, and
+ *  switches sites off through a flag of its own, so rules and the governor
+ *  don't undo each other: a site runs if both let it.
+ *
+ *  Gauge(pattern) counts the running stopwatches of matching sites, existing
+ *  and future ones, see stopwatchgauge.h; ReportGauges() prints them.
+ *
+ ********************************************************************************/
+
+class stopwatch_registry {
+public:
+    // the process wide registry, rules from STOPWATCH_ENABLE applied
+    static stopwatch_registry& Instance();
+
+    ~stopwatch_registry();
+
+    // the site of activity, created on first use. activity must outlive the
+    // registry (a string literal)
+    stopwatch_site& Register(char const* activity);
+
+    // add one rule and apply it to the existing sites
+    void Enable(char const* pattern, bool enable);
+
+    // replace all rules with a rule list and reapply them
+    void Configure(char const* rules);
+
+    // poll a control file holding a rule list, reapply when it changes.
+    // An empty path stops watching
+    void Watch(std::string const& path,
+               std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+    // call f(site) for every registered site
+    template <typename Fn> void ForEach(Fn f);
+
+    // count running stopwatches of the sites matching pattern, existing and
+    // registered later
+    void Gauge(char const* pattern);
+
+    // print the gauge of every site that has one, for the interval since
+    // the previous report
+    void ReportGauges(std::ostream& os = std::cout);
+
+    // glob match with * and ?
+    static bool Match(char const* pattern, char const* name);
+
+private:
+    struct rule {
+        std::string pattern;
+        bool        enable;
+    };
+
+    stopwatch_registry();
+    stopwatch_registry(stopwatch_registry const&);
+    stopwatch_registry& operator=(stopwatch_registry const&);
+
+    static std::vector<rule> Parse(char const* rules);
+    bool Decide(char const* activity) const;
+    void AttachGauge(stopwatch_site& site);
+    void WatchLoop(std::string path, std::chrono::milliseconds interval);
+    static long long MtimeNs(struct stat const& st);
+
+    std::mutex                  m_mutex;
+    std::deque<stopwatch_site>  m_sites;        // deque keeps addresses stable
+    std::vector<rule>           m_rules;
+    std::vector<std::string>    m_gauge_patterns;
+    std::deque<stopwatch_gauge> m_gauges;
+
+    std::mutex                  m_watch_mutex;
+    std::condition_variable     m_watch_cv;
+    std::thread                 m_watcher;
+    bool                        m_watch_stop;
+};
+
+inline stopwatch_registry& stopwatch_registry::Instance() {
+    static stopwatch_registry registry;
+    return registry;
+}
+
+inline stopwatch_registry::stopwatch_registry()
+  : m_watch_stop(false)
+{
+    char const* env = std::getenv("STOPWATCH_ENABLE");
+    if (env)
+        m_rules = Parse(env);
+}
+
+inline stopwatch_registry::~stopwatch_registry() {
+    Watch(std::string());
+}
+
+inline bool stopwatch_registry::Match(char const* pattern, char const* name) {
+    char const* star = nullptr;
+    char const* resume = nullptr;
+    while (*name) {
+        if (*pattern == '?' || *pattern == *name) {
+            ++pattern;
+            ++name;
+        }
+        else if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        }
+        else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return !*pattern;
+}
+
+inline std::vector<stopwatch_registry::rule> stopwatch_registry::Parse(char const* rules) {
+    std::vector<rule> out;
+    std::string token;
+    for (char const* p = rules; ; ++p) {
+        if (*p && !std::strchr(", \t\r\n", *p)) {
+            token += *p;
+            continue;
+        }
+        if (!token.empty() && token[0] != '#') {
+            rule r;
+            r.enable = token[0] != '-';
+            r.pattern = token[0] == '-' || token[0] == '+' ? token.substr(1) : token;
+            out.push_back(r);
+        }
+        token.clear();
+        if (!*p)
+            break;
+    }
+    return out;
+}
+
+inline bool stopwatch_registry::Decide(char const* activity) const {
+    bool enable = true;
+    for (size_t i = 0; i < m_rules.size(); ++i) {
+        if (Match(m_rules[i].pattern.c_str(), activity))
+            enable = m_rules[i].enable;
+    }
+    return enable;
+}
+
+inline stopwatch_site& stopwatch_registry::Register(char const* activity) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_sites.size(); ++i) {
+        if (!std::strcmp(m_sites[i].activity, activity))
+            return m_sites[i];
+    }
+    m_sites.emplace_back(activity);
+    m_sites.back().enabled.store(Decide(activity), std::memory_order_relaxed);
+    AttachGauge(m_sites.back());
+    return m_sites.back();
+}
+
+//  called with m_mutex held
+inline void stopwatch_registry::AttachGauge(stopwatch_site& site) {
+    if (site.gauge.load(std::memory_order_relaxed))
+        return;
+    for (size_t i = 0; i < m_gauge_patterns.size(); ++i) {
+        if (Match(m_gauge_patterns[i].c_str(), site.activity)) {
+            m_gauges.emplace_back(site.activity);
+            site.gauge.store(&m_gauges.back(), std::memory_order_release);
+            return;
+        }
+    }
+}
+
+inline void stopwatch_registry::Gauge(char const* pattern) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_gauge_patterns.push_back(pattern);
+    for (size_t i = 0; i < m_sites.size(); ++i)
+        AttachGauge(m_sites[i]);
+}
+
+inline void stopwatch_registry::ReportGauges(std::ostream& os) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_gauges.size(); ++i)
+        m_gauges[i].Print(os, m_gauges[i].Sample());
+}
+
+inline void stopwatch_registry::Enable(char const* pattern, bool enable) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    rule r;
+    r.pattern = pattern;
+    r.enable = enable;
+    m_rules.push_back(r);
+    for (size_t i = 0; i < m_sites.size(); ++i) {
+        if (Match(pattern, m_sites[i].activity))
+            m_sites[i].enabled.store(enable, std::memory_order_relaxed);
+    }
+}
+
+inline void stopwatch_registry::Configure(char const* rules) {
+    std::vector<rule> parsed = Parse(rules);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_rules.swap(parsed);
+    for (size_t i = 0; i < m_sites.size(); ++i)
+        m_sites[i].enabled.store(Decide(m_sites[i].activity), std::memory_order_relaxed);
+}
+
+template <typename Fn> inline void stopwatch_registry::ForEach(Fn f) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < m_sites.size(); ++i)
+        f(m_sites[i]);
+}
+
+inline void stopwatch_registry::Watch(std::string const& path, std::chrono::milliseconds interval) {
+    if (m_watcher.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_watch_mutex);
+            m_watch_stop = true;
+        }
+        m_watch_cv.notify_all();
+        m_watcher.join();
+    }
+    if (path.empty())
+        return;
+    m_watch_stop = false;
+    m_watcher = std::thread(&stopwatch_registry::WatchLoop, this, path, interval);
+}
+
+//  modification time in nS; whole seconds would miss a second write within
+//  the same second
+inline long long stopwatch_registry::MtimeNs(struct stat const& st) {
+#if defined(__APPLE__)
+    return (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+//  reread the file when its mtime, size or inode changes
+inline void stopwatch_registry::WatchLoop(std::string path, std::chrono::milliseconds interval) {
+    struct stat last;
+    std::memset(&last, 0, sizeof(last));
+    std::unique_lock<std::mutex> lock(m_watch_mutex);
+    while (!m_watch_stop) {
+        struct stat now;
+        if (stat(path.c_str(), &now) == 0
+            && (MtimeNs(now) != MtimeNs(last) || now.st_size != last.st_size || now.st_ino != last.st_ino)) {
+            last = now;
+            std::ifstream is(path.c_str());
+            std::stringstream ss;
+            ss << is.rdbuf();
+            Configure(ss.str().c_str());
+        }
+        m_watch_cv.wait_for(lock, interval);
+    }
+}
+
+//  the site of a call site, looked up once per call site
+#define STOPWATCH_SITE(activity) \
+    ([]() -> stopwatch_site& { \
+        static stopwatch_site& site = stopwatch_registry::Instance().Register(activity); \
+        return site; \
+    }())
+
+# endif
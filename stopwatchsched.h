@@ -0,0 +1,155 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_SCHED_H
+#define PERF_STOPWATCH_SCHED_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "stopwatch.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*******************************************************************************
+ *  TimerBaseSched -- scheduler delay attribution for a stopwatch lap
+ *
+ *  Wraps another timer base and snapshots the thread's
+ *  /proc/thread-self/schedstat (time on cpu, time runnable on a run queue,
+ *  timeslices) at Start() and at every lap. The lap then splits into the time
+ *  the thread ran, the time it was runnable but not scheduled, and the rest
+ *  (sleeping or blocked). A lap that spikes with RunqueueWait() means the
+ *  kernel didn't run us; one that spikes with OnCpu() means our code got
+ *  slower.
+ *
+ *      typedef basic_stopwatch< TimerBaseSched< TimerBaseChrono<
+ *          std::chrono::steady_clock, std::chrono::microseconds> > > SchedStopwatch;
+ *
+ *      SchedStopwatch sw("request");
+ *      ...
+ *      sw.Stop();
+ *      if (sw.RunqueueWait() > sw.LapDuration() / 2)
+ *          ...                                 // mostly waiting for a cpu
+ *
+ *  Each snapshot is one pread() of a per-thread file descriptor, about a
+ *  microsecond. Needs a kernel with schedstats (CONFIG_SCHED_INFO); without
+ *  them, or off Linux, the three values stay 0.
+ *
+ ********************************************************************************/
+
+struct sched_snapshot {
+    unsigned long long  run_ns;     // time on cpu
+    unsigned long long  wait_ns;    // time runnable on a run queue
+    unsigned long long  slices;     // timeslices run on this cpu
+
+    // read the calling thread's counters, false if unavailable
+    bool Read();
+};
+
+#if defined(__linux__)
+//  the calling thread's schedstat file, opened once per thread
+class sched_schedstat_fd {
+public:
+    sched_schedstat_fd() : m_fd(open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC)) {
+        if (m_fd < 0) {
+            char path[64];
+            std::snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat", (long)syscall(SYS_gettid));
+            m_fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+
+    ~sched_schedstat_fd() {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    int Get() const { return m_fd; }
+
+private:
+    sched_schedstat_fd(sched_schedstat_fd const&);
+    sched_schedstat_fd& operator=(sched_schedstat_fd const&);
+
+    int m_fd;
+};
+#endif
+
+inline bool sched_snapshot::Read() {
+    run_ns = wait_ns = slices = 0;
+#if defined(__linux__)
+    static thread_local sched_schedstat_fd fd;
+    if (fd.Get() < 0)
+        return false;
+    char buf[128];
+    ssize_t n = pread(fd.Get(), buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return false;
+    buf[n] = 0;
+    char* p = buf;
+    run_ns = std::strtoull(p, &p, 10);
+    wait_ns = std::strtoull(p, &p, 10);
+    slices = std::strtoull(p, &p, 10);
+    return true;
+#else
+    return false;
+#endif
+}
+
+template <typename Base>
+class TimerBaseSched : public Base {
+
+public:
+        typedef typename Base::duration duration;
+
+        TimerBaseSched() : m_ok(false) {
+                m_start.run_ns = m_start.wait_ns = m_start.slices = 0;
+                m_delta = m_start;
+        }
+
+        //      start the timer and snapshot the scheduler counters
+        void Start() {
+                m_ok = m_start.Read();
+                m_delta.run_ns = m_delta.wait_ns = m_delta.slices = 0;
+                Base::Start();
+        }
+
+        //      get the lap, and the scheduler counters since Start()
+        unsigned long GetMs() {
+                unsigned long lap = Base::GetMs();
+                sched_snapshot now;
+                if (m_ok && Base::IsStarted() && now.Read()) {
+                        m_delta.run_ns = now.run_ns - m_start.run_ns;
+                        m_delta.wait_ns = now.wait_ns - m_start.wait_ns;
+                        m_delta.slices = now.slices - m_start.slices;
+                }
+                return lap;
+        }
+
+        //      time on cpu during the last lap
+        duration OnCpu() const {
+                return std::chrono::duration_cast<duration>(std::chrono::nanoseconds(m_delta.run_ns));
+        }
+
+        //      time runnable but not scheduled during the last lap
+        duration RunqueueWait() const {
+                return std::chrono::duration_cast<duration>(std::chrono::nanoseconds(m_delta.wait_ns));
+        }
+
+        //      timeslices started during the last lap
+        unsigned long long Timeslices() const {
+                return m_delta.slices;
+        }
+
+        //      true if schedstat could be read at Start()
+        bool SchedAvailable() const {
+                return m_ok;
+        }
+private:
+        bool            m_ok;           // schedstat read at Start()
+        sched_snapshot  m_start;        // counters at Start()
+        sched_snapshot  m_delta;        // counters from Start() to the last lap
+};
+
+# endif
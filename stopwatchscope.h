@@ -0,0 +1,101 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_SCOPE_H
+#define PERF_STOPWATCH_SCOPE_H
+
+#include <chrono>
+#include "stopwatch.h"
+#include "stopwatchregistry.h"
+
+/*******************************************************************************
+ *  STOPWATCH_SCOPE -- stopwatch scopes with category and level
+ *
+ *  A scope times the rest of the enclosing block as activity "category.name".
+ *  Every category has a build time threshold; scopes below it compile to an
+ *  empty object that never touches a clock, the registry or the log. Scopes
+ *  at or above it are ordinary registered stopwatches, so they can still be
+ *  switched at runtime through stopwatch_registry ("-net.*").
+ *
+ *      STOPWATCH_CATEGORY(net, info)           // once, at namespace scope
+ *      STOPWATCH_CATEGORY(db, DB_LEVEL)        // -DDB_LEVEL=debug at build time
+ *
+ *      void Parse() {
+ *          STOPWATCH_SCOPE(net, debug, "parse");   // compiled out, debug < info
+ *          STOPWATCH_SCOPE(net, info, "request");  // times "net.request"
+ *          ...
+ *      }
+ *
+ *  Levels, lowest first: trace, debug, info, always. STOPWATCH_MIN_LEVEL
+ *  raises the threshold of every category, e.g. -DSTOPWATCH_MIN_LEVEL=info
+ *  for production builds. Define STOPWATCH_SCOPE_TIMER before including this
+ *  header to change the timer (default: steady_clock in microseconds).
+ *
+ ********************************************************************************/
+
+enum stopwatch_level {
+    stopwatch_level_trace,
+    stopwatch_level_debug,
+    stopwatch_level_info,
+    stopwatch_level_always
+};
+
+#ifndef STOPWATCH_MIN_LEVEL
+#define STOPWATCH_MIN_LEVEL trace
+#endif
+
+#ifndef STOPWATCH_SCOPE_TIMER
+#define STOPWATCH_SCOPE_TIMER TimerBaseChrono< std::chrono::steady_clock, std::chrono::microseconds>
+#endif
+
+//  level token (trace, debug, ...) to stopwatch_level, after macro expansion
+#define STOPWATCH_LEVEL(level) STOPWATCH_LEVEL_I(level)
+#define STOPWATCH_LEVEL_I(level) stopwatch_level_##level
+
+//  declare a category and its build time threshold
+#define STOPWATCH_CATEGORY(category, level) \
+    struct stopwatch_category_##category { \
+        enum { threshold = STOPWATCH_LEVEL(level) > STOPWATCH_LEVEL(STOPWATCH_MIN_LEVEL) \
+                         ? STOPWATCH_LEVEL(level) : STOPWATCH_LEVEL(STOPWATCH_MIN_LEVEL) }; \
+    };
+
+//  an enabled scope is a stopwatch on a registered call site
+template <typename T, bool Enabled> class stopwatch_scope : public basic_stopwatch<T> {
+public:
+    explicit stopwatch_scope(stopwatch_site& (*site)())
+      : basic_stopwatch<T>(site())
+    {
+    }
+};
+
+//  a compiled out scope, the site is never looked up
+template <typename T> class stopwatch_scope<T, false> {
+public:
+    typedef unsigned long tick_t;
+
+    explicit stopwatch_scope(stopwatch_site& (*)()) { }
+
+    tick_t LapGet() const                       { return 0; }
+    bool IsStarted() const                      { return false; }
+    tick_t Show(char const* = "show")           { return 0; }
+    tick_t Start(char const* = "start")         { return 0; }
+    tick_t Stop(char const* = "stop")           { return 0; }
+};
+
+#define STOPWATCH_SCOPE_CONCAT(a, b) STOPWATCH_SCOPE_CONCAT_I(a, b)
+#define STOPWATCH_SCOPE_CONCAT_I(a, b) a##b
+
+//  unique per use, so that two scopes on one line (from a macro) don't clash
+#if defined(__COUNTER__)
+#define STOPWATCH_SCOPE_ID __COUNTER__
+#else
+#define STOPWATCH_SCOPE_ID __LINE__
+#endif
+
+//  time the rest of the block as "category.activity", activity is a literal
+#define STOPWATCH_SCOPE(category, level, activity) \
+    stopwatch_scope< STOPWATCH_SCOPE_TIMER, \
+                     (STOPWATCH_LEVEL(level) >= (int)stopwatch_category_##category::threshold) > \
+        STOPWATCH_SCOPE_CONCAT(stopwatch_scope_, STOPWATCH_SCOPE_ID)( \
+            []() -> stopwatch_site& { return STOPWATCH_SITE(#category "." activity); })
+
+# endif
@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_SHARDS_H
+#define PERF_STOPWATCH_SHARDS_H
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "stopwatchclocksync.h"
+
+/*******************************************************************************
+ *  stopwatch_shards, stopwatch_names -- the plumbing of per thread statistics
+ *
+ *  stopwatch_shards<Shard> gives each thread a Shard of its own, so threads
+ *  recording into one statistic don't contend: Local() is the calling
+ *  thread's shard, ForEach() visits every shard for a read to merge. The
+ *  gauges (stopwatchgauge.h), lock stats (stopwatchlock.h) and task stats
+ *  (stopwatchtask.h) keep their counters in one.
+ *
+ *      struct shard { std::mutex mutex; Histogram h; };
+ *      stopwatch_shards<shard> m_shards;
+ *      ...
+ *      shard& s = m_shards.Local();            // record
+ *      m_shards.ForEach([&](shard& s) { ... }); // merge
+ *
+ *  A thread's shard is handed to the next new thread when it exits. The
+ *  shards are held by the threads that used them as well as by the
+ *  stopwatch_shards, so a statistic may be destroyed before those threads
+ *  exit; a thread drops the shards of destroyed statistics when it next
+ *  takes a new one.
+ *
+ *  stopwatch_names<Stats> keeps the Stats of each name, created on first
+ *  use and kept for the life of the program.
+ *
+ ********************************************************************************/
+
+template <typename Shard> class stopwatch_shards {
+public:
+    stopwatch_shards() : m_state(std::make_shared<state>()) { }
+
+    // the calling thread's shard, a free one or a new one on its first use
+    Shard& Local();
+
+    // call f(shard) for every shard, under the lock that hands them out
+    template <typename Fn> void ForEach(Fn f) const;
+
+private:
+    stopwatch_shards(stopwatch_shards const&);
+    stopwatch_shards& operator=(stopwatch_shards const&);
+
+    struct slot {
+        Shard   shard;
+        bool    in_use;             // owned by a live thread, under state::mutex
+
+        slot() : in_use(false) { }
+    };
+
+    struct state {
+        std::mutex          mutex;  // guards shards and in_use
+        std::deque<slot>    shards; // deque keeps addresses stable
+    };
+
+    struct owned_slot {
+        std::shared_ptr<state>  owner;
+        slot*                   taken;
+    };
+
+    //  the shards the calling thread owns, released when it exits
+    struct thread_shards {
+        std::vector<owned_slot> owned;
+
+        ~thread_shards() {
+            for (size_t i = 0; i < owned.size(); ++i) {
+                std::lock_guard<std::mutex> lock(owned[i].owner->mutex);
+                owned[i].taken->in_use = false;
+            }
+        }
+    };
+
+    std::shared_ptr<state>  m_state;
+};
+
+//  the thread's own list is searched first, without a lock. Entries whose
+//  statistic is gone, held by this thread alone, are dropped on a miss
+template <typename Shard> inline Shard& stopwatch_shards<Shard>::Local() {
+    static thread_local thread_shards t;
+    state* st = m_state.get();
+    for (size_t i = 0; i < t.owned.size(); ++i) {
+        if (t.owned[i].owner.get() == st)
+            return t.owned[i].taken->shard;
+    }
+    for (size_t i = t.owned.size(); i-- > 0; ) {
+        if (t.owned[i].owner.use_count() == 1) {
+            t.owned[i] = t.owned.back();
+            t.owned.pop_back();
+        }
+    }
+    std::lock_guard<std::mutex> lock(st->mutex);
+    slot* s = nullptr;
+    for (size_t i = 0; i < st->shards.size() && !s; ++i) {
+        if (!st->shards[i].in_use)
+            s = &st->shards[i];
+    }
+    if (!s) {
+        st->shards.emplace_back();
+        s = &st->shards.back();
+    }
+    s->in_use = true;
+    owned_slot o = { m_state, s };
+    t.owned.push_back(o);
+    return s->shard;
+}
+
+template <typename Shard> template <typename Fn> inline void stopwatch_shards<Shard>::ForEach(Fn f) const {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    for (size_t i = 0; i < m_state->shards.size(); ++i)
+        f(m_state->shards[i].shard);
+}
+
+template <typename Stats> class stopwatch_names {
+public:
+    // the stats of name, created on first use. name must outlive the
+    // program (a string literal)
+    static Stats& Get(char const* name);
+
+    // call f(stats) for every name
+    template <typename Fn> static void ForEach(Fn f);
+
+private:
+    struct registry {
+        std::mutex          mutex;
+        std::deque<Stats>   stats;  // deque keeps addresses stable
+    };
+
+    static registry& Registry() {
+        static registry r;
+        return r;
+    }
+};
+
+template <typename Stats> inline Stats& stopwatch_names<Stats>::Get(char const* name) {
+    registry& r = Registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (size_t i = 0; i < r.stats.size(); ++i) {
+        if (!std::strcmp(r.stats[i].Name(), name))
+            return r.stats[i];
+    }
+    r.stats.emplace_back(name);
+    return r.stats.back();
+}
+
+template <typename Stats> template <typename Fn> inline void stopwatch_names<Stats>::ForEach(Fn f) {
+    registry& r = Registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (size_t i = 0; i < r.stats.size(); ++i)
+        f(r.stats[i]);
+}
+
+//  ticks of Clock in nS, 0 for negative intervals
+template <typename Clock> inline unsigned long long clock_ticks_ns(long long ticks) {
+    static double const ns_per_tick = clock_ticks<Clock>::nominal_ns_per_tick();
+    return ticks > 0 ? (unsigned long long)((double)ticks * ns_per_tick) : 0;
+}
+
+# endif
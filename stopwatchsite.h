@@ -0,0 +1,170 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_SITE_H
+#define PERF_STOPWATCH_SITE_H
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <time.h>
+#include "stopwatchgauge.h"
+
+/*******************************************************************************
+ *  struct stopwatch_site -- the per call site state a stopwatch consults
+ *
+ *  What basic_stopwatch needs of a call site: whether to run, its sampling,
+ *  the cost it is charged and its gauge. stopwatch.h includes only this;
+ *  sites are created and switched by stopwatch_registry, include
+ *  stopwatchregistry.h for STOPWATCH_SITE() and the rules, and
+ *  stopwatchgovernor.h for the overhead governor.
+ *
+ ********************************************************************************/
+
+//  CPU time of the calling thread in nS, so that blocking and preemption
+//  aren't charged as cost; steady_clock where there is no thread CPU clock
+inline long long stopwatch_thread_cpu_ns() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//  per thread, per site counters used by stopwatch_site::Admit(), so that a
+//  hot site doesn't take the sampling and measurement turns of the others
+struct stopwatch_thread_ticks {
+    unsigned    calls;          // admitted or sampled out scopes
+    unsigned    countdown;      // scopes until the next cost measurement
+};
+
+inline stopwatch_thread_ticks& stopwatch_ticks(unsigned site_index) {
+    static thread_local std::vector<stopwatch_thread_ticks> ticks;
+    if (site_index >= ticks.size()) {
+        stopwatch_thread_ticks fresh = { 0, 1 };
+        ticks.resize(site_index + 1, fresh);
+    }
+    return ticks[site_index];
+}
+
+//  the next dense site index
+inline unsigned stopwatch_site_index() {
+    static std::atomic<unsigned> next(0);
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+//  true while a stopwatch_governor measures overhead
+inline std::atomic<bool>& stopwatch_governed() {
+    static std::atomic<bool> governed(false);
+    return governed;
+}
+
+struct stopwatch_site {
+    // 1 in cost_stride admitted scopes measures its own bookkeeping cost
+    static unsigned const cost_stride = 61;
+
+    char const*                         activity;       // name shared by the call sites
+    unsigned                            index;          // of its per thread counters
+    std::atomic<bool>                   enabled;        // set by rules and the API
+    std::atomic<bool>                   governed;       // false while the governor switched it off
+    std::atomic<unsigned>               sample_shift;   // run 1 in 2^shift scopes
+    std::atomic<unsigned long long>     cost_ns;        // estimated bookkeeping nS
+    std::atomic<bool>                   throttled;      // shift/governed set by the governor
+    std::atomic<stopwatch_gauge*>       gauge;          // counts running stopwatches, or null
+
+    explicit stopwatch_site(char const* name)
+      : activity(name), index(stopwatch_site_index()), enabled(true), governed(true), sample_shift(0), cost_ns(0), throttled(false), gauge(nullptr) { }
+
+    // switched on by the rules, whatever the governor did
+    bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    // decide for a new stopwatch: 0 skip it, 1 run it, 2 run it and measure
+    // what its clock reads, probes, gauge and printing cost
+    int Admit() const {
+        if (!IsEnabled() || !governed.load(std::memory_order_relaxed))
+            return 0;
+        stopwatch_thread_ticks& t = stopwatch_ticks(index);
+        unsigned shift = sample_shift.load(std::memory_order_relaxed);
+        if (shift && (++t.calls & ((1u << shift) - 1)))
+            return 0;
+        if (!stopwatch_governed().load(std::memory_order_relaxed) || --t.countdown)
+            return 1;
+        t.countdown = cost_stride;
+        return 2;
+    }
+};
+
+//  adds the cost of the bookkeeping between construction and destruction to
+//  a site, scaled up for the scopes that weren't measured. The cost is the
+//  thread CPU time, so blocking and preemption aren't charged; when the
+//  thread ran throughout, the steady_clock interval inside the CPU clock
+//  reads is the same time without the reads' own cost, and the smaller of
+//  the two is taken. Both less what back to back reads of the clock give
+class stopwatch_cost_guard {
+public:
+    explicit stopwatch_cost_guard(stopwatch_site* site)
+      : m_site(site)
+      , m_cpu(0)
+    {
+        if (m_site) {
+            m_cpu = stopwatch_thread_cpu_ns();
+            m_wall = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~stopwatch_cost_guard() {
+        if (m_site) {
+            std::chrono::steady_clock::time_point wall = std::chrono::steady_clock::now();
+            long long cpu = stopwatch_thread_cpu_ns() - m_cpu - CpuOverhead();
+            long long ns = (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(wall - m_wall).count()
+                         - WallOverhead();
+            if (cpu < ns)
+                ns = cpu;
+            if (ns > 0)
+                m_site->cost_ns.fetch_add((unsigned long long)ns * stopwatch_site::cost_stride,
+                                          std::memory_order_relaxed);
+        }
+    }
+
+private:
+    //  shortest intervals between two clock reads
+    static long long CpuOverhead() {
+        static long long const overhead = MeasureCpuOverhead();
+        return overhead;
+    }
+
+    static long long WallOverhead() {
+        static long long const overhead = MeasureWallOverhead();
+        return overhead;
+    }
+
+    static long long MeasureCpuOverhead() {
+        long long best = -1;
+        for (int i = 0; i < 16; ++i) {
+            long long t0 = stopwatch_thread_cpu_ns();
+            long long ns = stopwatch_thread_cpu_ns() - t0;
+            if (best < 0 || ns < best)
+                best = ns;
+        }
+        return best;
+    }
+
+    static long long MeasureWallOverhead() {
+        long long best = -1;
+        for (int i = 0; i < 16; ++i) {
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            long long ns = (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+            if (best < 0 || ns < best)
+                best = ns;
+        }
+        return best;
+    }
+
+    stopwatch_site*                         m_site;
+    long long                               m_cpu;      // thread CPU nS
+    std::chrono::steady_clock::time_point   m_wall;
+};
+
+# endif
@@ -0,0 +1,213 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_TASK_H
+#define PERF_STOPWATCH_TASK_H
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include "stopwatchformat.h"
+#include "stopwatchhist.h"
+#include "stopwatchshards.h"
+
+/*******************************************************************************
+ *  timed_task -- queue wait and execution time of tasks run by an executor
+ *
+ *  Wrapping a callable stamps the time of submission; when the executor
+ *  runs it, the time spent queued and the time spent executing are recorded
+ *  separately, per task type name, into Histograms in nanoseconds. A
+ *  stopwatch inside the task body only sees the second part.
+ *
+ *      pool.submit(STOPWATCH_TASK("parse", [req] { Parse(req); }));
+ *      ...
+ *      task_stats::Report();
+ *
+ *  STOPWATCH_TASK looks the task type up once per call site;
+ *  timed_task_wrap(name, fn) looks it up on every call, and
+ *  timed_task_wrap(stats, fn) takes the stats, of any clock, directly.
+ *
+ *  What it reports, per task type
+ *      "task parse: 120345 run, queue p50 12031ns p99 2013265ns max 9120121ns, exec p50 8411ns p99 40111ns max 911021ns, 71.2% of time queued"
+ *
+ *  The wrapper holds the callable, a stats pointer and the submission
+ *  tick, and allocates nothing itself; it is movable, and copyable when the
+ *  callable is, so it fits any executor taking callables (std::function,
+ *  std::packaged_task, std::thread, ...). Wrap right before submitting, the
+ *  queue wait counts from the wrap. Every call records once; arguments and
+ *  the result are passed through.
+ *
+ *  Each thread records into its own shard of the task type's stats, two
+ *  histograms behind a mutex only readers ever contend, so pool workers
+ *  running the same task type don't serialize on the stats. Reads merge
+ *  the shards; a thread's shard is handed to the next new thread when it
+ *  exits. The clock is read through clock_ticks<Clock>, see
+ *  stopwatchclocksync.h.
+ *
+ ********************************************************************************/
+
+template <typename Clock = std::chrono::steady_clock> class basic_task_stats {
+public:
+    // the stats of a task type, created on first use. name must outlive the
+    // program (a string literal)
+    static basic_task_stats& Get(char const* name);
+
+    // call f(stats) for every task type
+    template <typename Fn> static void ForEach(Fn f);
+
+    // print every task type that ran
+    static void Report(std::ostream& os = std::cout);
+
+    char const* Name() const { return m_name; }
+
+    // record one run
+    void Record(long long queue_ticks, long long exec_ticks);
+
+    // copies of the histograms, nS
+    Histogram Queue() const;
+    Histogram Exec() const;
+
+    void Print(std::ostream& os) const;
+
+    explicit basic_task_stats(char const* name) : m_name(name) { }
+
+private:
+    //  what one thread recorded
+    struct shard {
+        mutable std::mutex  mutex;  // held by the thread to record, by readers to merge
+        Histogram           queue;
+        Histogram           exec;
+    };
+
+    basic_task_stats(basic_task_stats const&);
+    basic_task_stats& operator=(basic_task_stats const&);
+
+    void Merge(Histogram* queue, Histogram* exec) const;
+
+    char const*                 m_name;
+    stopwatch_shards<shard>     m_shards;
+};
+
+typedef basic_task_stats<> task_stats;
+
+template <typename Clock> inline basic_task_stats<Clock>& basic_task_stats<Clock>::Get(char const* name) {
+    return stopwatch_names<basic_task_stats>::Get(name);
+}
+
+template <typename Clock> template <typename Fn> inline void basic_task_stats<Clock>::ForEach(Fn f) {
+    stopwatch_names<basic_task_stats>::ForEach(f);
+}
+
+template <typename Clock> inline void basic_task_stats<Clock>::Report(std::ostream& os) {
+    ForEach([&os](basic_task_stats& s) { s.Print(os); });
+}
+
+template <typename Clock> inline void basic_task_stats<Clock>::Record(long long queue_ticks, long long exec_ticks) {
+    unsigned long long queue = clock_ticks_ns<Clock>(queue_ticks);
+    unsigned long long exec = clock_ticks_ns<Clock>(exec_ticks);
+    shard& s = m_shards.Local();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.queue.Record(queue);
+    s.exec.Record(exec);
+}
+
+template <typename Clock> inline void basic_task_stats<Clock>::Merge(Histogram* queue, Histogram* exec) const {
+    m_shards.ForEach([&](shard const& s) {
+        std::lock_guard<std::mutex> shard_lock(s.mutex);
+        if (queue)
+            queue->Merge(s.queue);
+        if (exec)
+            exec->Merge(s.exec);
+    });
+}
+
+template <typename Clock> inline Histogram basic_task_stats<Clock>::Queue() const {
+    Histogram h;
+    Merge(&h, nullptr);
+    return h;
+}
+
+template <typename Clock> inline Histogram basic_task_stats<Clock>::Exec() const {
+    Histogram h;
+    Merge(nullptr, &h);
+    return h;
+}
+
+template <typename Clock> inline void basic_task_stats<Clock>::Print(std::ostream& os) const {
+    Histogram queue, exec;
+    Merge(&queue, &exec);
+    if (!exec.Count())
+        return;
+    double total = (double)queue.Sum() + (double)exec.Sum();
+    char const* ns = stopwatch_unit<std::chrono::nanoseconds>::suffix();
+    char pct[32];
+    std::snprintf(pct, sizeof(pct), "%.1f%%", total > 0.0 ? 100.0 * (double)queue.Sum() / total : 0.0);
+    os << "task " << m_name << ": " << exec.Count() << " run"
+       << ", queue p50 " << queue.Percentile(50.0) << ns << " p99 " << queue.Percentile(99.0)
+       << ns << " max " << queue.Max() << ns
+       << ", exec p50 " << exec.Percentile(50.0) << ns << " p99 " << exec.Percentile(99.0)
+       << ns << " max " << exec.Max() << ns << ", " << pct << " of time queued" << std::endl << std::flush;
+}
+
+//  a callable stamped at submission, recording queue wait and execution
+template <typename Fn, typename Clock = std::chrono::steady_clock> class timed_task {
+public:
+    typedef basic_task_stats<Clock> stats_type;
+
+    timed_task(stats_type& stats, Fn fn)
+      : m_fn(std::move(fn))
+      , m_stats(&stats)
+      , m_submitted(clock_ticks<Clock>::now())
+    {
+    }
+
+    template <typename... Args>
+    auto operator()(Args&&... args) -> decltype(std::declval<Fn&>()(std::forward<Args>(args)...)) {
+        run_guard guard(*this);
+        return m_fn(std::forward<Args>(args)...);
+    }
+
+    // restamp, e.g. when the task is resubmitted
+    void Submitted() { m_submitted = clock_ticks<Clock>::now(); }
+
+private:
+    //  records at the end of the run, however it ends
+    struct run_guard {
+        timed_task& task;
+        long long   start;
+
+        explicit run_guard(timed_task& t) : task(t), start(clock_ticks<Clock>::now()) { }
+
+        ~run_guard() {
+            task.m_stats->Record(start - task.m_submitted, clock_ticks<Clock>::now() - start);
+        }
+    };
+
+    Fn              m_fn;
+    stats_type*     m_stats;
+    long long       m_submitted;    // ticks at wrap or Submitted()
+};
+
+//  wrap fn as a task counted in stats, stamped now
+template <typename Clock, typename Fn>
+inline timed_task<typename std::decay<Fn>::type, Clock> timed_task_wrap(basic_task_stats<Clock>& stats, Fn&& fn) {
+    return timed_task<typename std::decay<Fn>::type, Clock>(stats, std::forward<Fn>(fn));
+}
+
+//  the same, looking the task type up by name on every call
+template <typename Fn>
+inline timed_task<typename std::decay<Fn>::type> timed_task_wrap(char const* name, Fn&& fn) {
+    return timed_task_wrap(task_stats::Get(name), std::forward<Fn>(fn));
+}
+
+//  wrap a callable as a task of type name, looked up once per call site.
+//  Variadic so that lambdas with commas in them pass through
+#define STOPWATCH_TASK(name, ...) \
+    timed_task_wrap(([]() -> task_stats& { \
+        static task_stats& stats = task_stats::Get(name); \
+        return stats; \
+    }()), __VA_ARGS__)
+
+# endif
@@ -0,0 +1,424 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_TOPDOWN_H
+#define PERF_STOPWATCH_TOPDOWN_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "stopwatchperf.h"
+
+/*******************************************************************************
+ *  TimerBaseTopdown -- top-down level 1 breakdown per stopwatch lap
+ *
+ *  Wraps another timer base and reads hardware counters on the calling thread
+ *  at Start() and at every lap, then splits the lap's pipeline slots into the
+ *  four top-down level 1 categories, plus IPC and memory indicators.
+ *
+ *      typedef basic_stopwatch< TimerBaseTopdown< TimerBaseChrono<
+ *          std::chrono::steady_clock, std::chrono::microseconds> > > TopdownStopwatch;
+ *
+ *      TopdownStopwatch sw("join", false);
+ *      sw.Start();
+ *      ...
+ *      sw.Stop();
+ *      sw.Topdown().Print(std::cout, "join");
+ *
+ *  What it prints
+ *      "join: retiring 21.4% frontend 6.0% bad speculation 2.1% backend 70.5% memory 61.3% ipc 0.84 llc mpki 18.2"
+ *      "join: frontend ~12.0% backend ~55.1% ... ipc 1.12"          ('~', approximation)
+ *
+ *  The fractions come from the first of these the CPU has, as events of
+ *  the cpu or cpu_core PMU in sysfs:
+ *
+ *  1. Intel with perf metrics (Icelake on): slots and the topdown-retiring,
+ *     -bad-spec, -fe-bound, -be-bound and -mem-bound metrics, each over slots.
+ *
+ *  2. Intel before Icelake: the level 1 events, total slots being 4 per
+ *     core cycle, from the sysfs scale of each event
+ *      frontend        topdown-fetch-bubbles / topdown-total-slots
+ *      bad speculation (topdown-slots-issued - topdown-slots-retired
+ *                       + topdown-recovery-bubbles) / topdown-total-slots
+ *      retiring        topdown-slots-retired / topdown-total-slots
+ *      backend         the rest
+ *
+ *  3. Anywhere else, an approximation from generic cycle events, which
+ *     counts stalled cycles rather than slots and doesn't add up to what
+ *     the top-down method would report; printed with '~':
+ *      frontend        stalled-cycles-frontend / cycles
+ *      backend         stalled-cycles-backend / cycles
+ *      bad speculation branch-misses * 20 cycles / cycles, at most what is left
+ *      retiring        the rest
+ *
+ *  Memory bound is topdown-mem-bound where it exists, else backend bound
+ *  times the share of cycles an LLC miss stalls (cache-misses * 100 cycles).
+ *  Values the counters can't give are negative and print as "-".
+ *
+ *  Needs a PMU visible to the process (most VMs have none) and
+ *  perf_event_paranoid <= 2; kernel cycles aren't counted at 2.
+ *
+ ********************************************************************************/
+
+struct topdown_metrics {
+    double  frontend_bound;     // fractions of the lap's pipeline slots
+    double  backend_bound;
+    double  bad_speculation;
+    double  retiring;
+    double  memory_bound;       // part of backend_bound waiting for memory
+    double  ipc;                // instructions per cycle
+    double  llc_mpki;           // last level cache misses per 1000 instructions
+    bool    estimated;          // approximated from generic cycle events, not slots
+
+    topdown_metrics()
+      : frontend_bound(-1.0), backend_bound(-1.0), bad_speculation(-1.0), retiring(-1.0)
+      , memory_bound(-1.0), ipc(-1.0), llc_mpki(-1.0), estimated(false) { }
+
+    // one line, "activity: retiring 21.4% ..."
+    void Print(std::ostream& os, char const* activity) const {
+        char const* mark = estimated ? "~" : "";
+        os << activity << ":";
+        Percent(os, " retiring ", mark, retiring);
+        Percent(os, " frontend ", mark, frontend_bound);
+        Percent(os, " bad speculation ", mark, bad_speculation);
+        Percent(os, " backend ", mark, backend_bound);
+        Percent(os, " memory ", mark, memory_bound);
+        os << " ipc ";
+        Number(os, ipc);
+        os << " llc mpki ";
+        Number(os, llc_mpki);
+        os << std::endl << std::flush;
+    }
+
+private:
+    static void Percent(std::ostream& os, char const* name, char const* mark, double v) {
+        os << name;
+        if (v < 0.0) {
+            os << "-";
+            return;
+        }
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%s%.1f%%", mark, 100.0 * v);
+        os << buf;
+    }
+
+    static void Number(std::ostream& os, double v) {
+        if (v < 0.0) {
+            os << "-";
+            return;
+        }
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.2f", v);
+        os << buf;
+    }
+};
+
+//  the calling thread's top-down and generic hardware counters
+class perf_topdown_counters {
+public:
+    enum {                      // topdown group, slots leads
+        td_slots, td_retiring, td_bad_spec, td_fe_bound, td_be_bound, td_mem_bound, td_count
+    };
+    enum {                      // pre-Icelake level 1 group, total slots leads
+        sl_total, sl_issued, sl_retired, sl_fetch_bubbles, sl_recovery_bubbles, sl_count
+    };
+    enum {                      // generic group, cycles leads
+        hw_cycles, hw_instructions, hw_cache_misses, hw_branch_misses, hw_stalled_fe, hw_stalled_be, hw_count
+    };
+
+    // counters at one end of a lap
+    struct snapshot {
+        unsigned long long  td[perf_counter_group::max_events];
+        unsigned long long  sl[perf_counter_group::max_events];
+        unsigned long long  hw[perf_counter_group::max_events];
+    };
+
+    perf_topdown_counters() {
+        for (unsigned i = 0; i < td_count; ++i)
+            m_td_index[i] = perf_counter_group::max_events;
+        for (unsigned i = 0; i < sl_count; ++i) {
+            m_sl_index[i] = perf_counter_group::max_events;
+            m_sl_scale[i] = 1.0;
+        }
+        for (unsigned i = 0; i < hw_count; ++i)
+            m_hw_index[i] = perf_counter_group::max_events;
+#if defined(__linux__)
+        static char const* const td_names[td_count] = {
+            "slots", "topdown-retiring", "topdown-bad-spec", "topdown-fe-bound",
+            "topdown-be-bound", "topdown-mem-bound"
+        };
+        char const* pmu = nullptr;
+        unsigned type = 0;
+        unsigned long long config;
+        if (PmuType("cpu", type) && PmuEvent("cpu", "slots", config))
+            pmu = "cpu";
+        else if (PmuType("cpu_core", type) && PmuEvent("cpu_core", "slots", config))
+            pmu = "cpu_core";
+        for (unsigned i = 0; pmu && i < td_count; ++i) {
+            if (PmuEvent(pmu, td_names[i], config))
+                m_topdown.Add(type, config, &m_td_index[i]);
+        }
+        if (pmu && !(m_topdown.Open() && Has(td_slots) && Has(td_retiring)))
+            m_td_index[td_slots] = perf_counter_group::max_events;
+
+        static char const* const sl_names[sl_count] = {
+            "topdown-total-slots", "topdown-slots-issued", "topdown-slots-retired",
+            "topdown-fetch-bubbles", "topdown-recovery-bubbles"
+        };
+        pmu = nullptr;
+        if (!Has(td_slots) && PmuType("cpu", type) && PmuEvent("cpu", sl_names[sl_total], config))
+            pmu = "cpu";
+        for (unsigned i = 0; pmu && i < sl_count; ++i) {
+            if (!PmuEvent(pmu, sl_names[i], config)) {
+                pmu = nullptr;
+                break;
+            }
+            m_slots.Add(type, config, &m_sl_index[i]);
+            m_sl_scale[i] = PmuScale(pmu, sl_names[i]);
+        }
+        if (pmu && !m_slots.Open())
+            pmu = nullptr;
+        for (unsigned i = 0; pmu && i < sl_count; ++i) {
+            if (!m_slots.Available(m_sl_index[i]))
+                pmu = nullptr;
+        }
+        if (!pmu)
+            m_sl_index[sl_total] = perf_counter_group::max_events;
+
+        static unsigned long long const hw_config[hw_count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND,
+            PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+        };
+        for (unsigned i = 0; i < hw_count; ++i)
+            m_generic.Add(PERF_TYPE_HARDWARE, hw_config[i], &m_hw_index[i]);
+        m_generic.Open();
+#endif
+    }
+
+    static perf_topdown_counters& Instance() {
+        static thread_local perf_topdown_counters counters;
+        return counters;
+    }
+
+    // read the groups, false if none counts
+    bool Read(snapshot& s) const {
+        bool td = m_topdown.Read(s.td);
+        bool sl = m_slots.Read(s.sl);
+        bool hw = m_generic.Read(s.hw);
+        return td || sl || hw;
+    }
+
+    // the metrics between two snapshots
+    topdown_metrics Metrics(snapshot const& a, snapshot const& b) const {
+        topdown_metrics m;
+        double cycles = HwDelta(a, b, hw_cycles);
+        double instructions = HwDelta(a, b, hw_instructions);
+        double misses = HwDelta(a, b, hw_cache_misses);
+        if (cycles > 0.0 && instructions >= 0.0)
+            m.ipc = instructions / cycles;
+        if (instructions > 0.0 && misses >= 0.0)
+            m.llc_mpki = misses * 1000.0 / instructions;
+
+        double slots = TdDelta(a, b, td_slots);
+        double total = SlDelta(a, b, sl_total);
+        if (slots > 0.0) {
+            m.retiring = Fraction(TdDelta(a, b, td_retiring), slots);
+            m.bad_speculation = Fraction(TdDelta(a, b, td_bad_spec), slots);
+            m.frontend_bound = Fraction(TdDelta(a, b, td_fe_bound), slots);
+            m.backend_bound = Fraction(TdDelta(a, b, td_be_bound), slots);
+            m.memory_bound = Fraction(TdDelta(a, b, td_mem_bound), slots);
+        }
+        else if (total > 0.0) {
+            double issued = SlDelta(a, b, sl_issued);
+            double retired = SlDelta(a, b, sl_retired);
+            double wasted = issued - retired + SlDelta(a, b, sl_recovery_bubbles);
+            m.frontend_bound = Fraction(SlDelta(a, b, sl_fetch_bubbles), total);
+            m.bad_speculation = Fraction(wasted > 0.0 ? wasted : 0.0, total);
+            m.retiring = Fraction(retired, total);
+            double left = 1.0 - m.frontend_bound - m.bad_speculation - m.retiring;
+            m.backend_bound = left > 0.0 ? left : 0.0;
+        }
+        else if (cycles > 0.0) {
+            double fe = HwDelta(a, b, hw_stalled_fe);
+            double be = HwDelta(a, b, hw_stalled_be);
+            double br = HwDelta(a, b, hw_branch_misses);
+            if (fe < 0.0 || be < 0.0)
+                return m;
+            m.estimated = true;
+            m.frontend_bound = Fraction(fe, cycles);
+            m.backend_bound = Fraction(be, cycles);
+            double left = 1.0 - m.frontend_bound - m.backend_bound;
+            left = left > 0.0 ? left : 0.0;
+            if (br >= 0.0) {
+                m.bad_speculation = Fraction(br * (double)branch_miss_cycles, cycles);
+                m.bad_speculation = m.bad_speculation < left ? m.bad_speculation : left;
+                m.retiring = left - m.bad_speculation;
+            }
+            if (misses >= 0.0) {
+                double share = Fraction(misses * (double)llc_miss_cycles, cycles);
+                m.memory_bound = m.backend_bound * share;
+            }
+        }
+        if ((slots > 0.0 || total > 0.0) && m.memory_bound < 0.0 && misses >= 0.0 && cycles > 0.0)
+            m.memory_bound = m.backend_bound * Fraction(misses * (double)llc_miss_cycles, cycles);
+        return m;
+    }
+
+    // true if the CPU's own top-down metrics or level 1 events are counted
+    bool Exact() const { return Has(td_slots) || m_slots.Available(m_sl_index[sl_total]); }
+
+private:
+    enum {
+        branch_miss_cycles = 20,                // estimated penalty of a branch miss
+        llc_miss_cycles = 100                   // estimated stall of an LLC miss
+    };
+
+    bool Has(unsigned td) const { return m_topdown.Available(m_td_index[td]); }
+
+    double TdDelta(snapshot const& a, snapshot const& b, unsigned td) const {
+        if (!Has(td) || !Has(td_slots))
+            return -1.0;
+        return (double)(b.td[m_td_index[td]] - a.td[m_td_index[td]]);
+    }
+
+    double SlDelta(snapshot const& a, snapshot const& b, unsigned sl) const {
+        if (!m_slots.Available(m_sl_index[sl]) || !m_slots.Available(m_sl_index[sl_total]))
+            return -1.0;
+        return (double)(b.sl[m_sl_index[sl]] - a.sl[m_sl_index[sl]]) * m_sl_scale[sl];
+    }
+
+    double HwDelta(snapshot const& a, snapshot const& b, unsigned hw) const {
+        if (!m_generic.Available(m_hw_index[hw]))
+            return -1.0;
+        return (double)(b.hw[m_hw_index[hw]] - a.hw[m_hw_index[hw]]);
+    }
+
+    static double Fraction(double part, double whole) {
+        if (part < 0.0)
+            return -1.0;
+        double f = part / whole;
+        return f < 1.0 ? f : 1.0;
+    }
+
+    //  perf type of a PMU, /sys/bus/event_source/devices/<pmu>/type
+    static bool PmuType(char const* pmu, unsigned& type) {
+        char path[128];
+        std::snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/type", pmu);
+        FILE* f = std::fopen(path, "r");
+        if (!f)
+            return false;
+        bool ok = std::fscanf(f, "%u", &type) == 1;
+        std::fclose(f);
+        return ok;
+    }
+
+    //  the factor a named PMU event's count is scaled by, <event>.scale, 1
+    //  without one. Pre-Icelake total slots and recovery bubbles count per
+    //  cycle and are scaled by the slots per cycle
+    static double PmuScale(char const* pmu, char const* event) {
+        char path[160];
+        std::snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s.scale", pmu, event);
+        FILE* f = std::fopen(path, "r");
+        if (!f)
+            return 1.0;
+        double scale = 1.0;
+        if (std::fscanf(f, "%lf", &scale) != 1 || scale <= 0.0)
+            scale = 1.0;
+        std::fclose(f);
+        return scale;
+    }
+
+    //  raw config of a named PMU event, "event=0x00,umask=0x81" in the
+    //  Intel layout: event in bits 0-7, umask in bits 8-15, edge 18, any
+    //  21, inv 23, cmask 24-31
+    static bool PmuEvent(char const* pmu, char const* event, unsigned long long& config) {
+        char path[160];
+        std::snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s", pmu, event);
+        FILE* f = std::fopen(path, "r");
+        if (!f)
+            return false;
+        char line[128] = { 0 };
+        bool ok = std::fgets(line, sizeof(line), f) != nullptr;
+        std::fclose(f);
+        if (!ok)
+            return false;
+        config = 0;
+        for (char* p = line; *p; ) {
+            char* eq = std::strchr(p, '=');
+            if (!eq)
+                break;
+            unsigned long long v = std::strtoull(eq + 1, nullptr, 0);
+            if (!std::strncmp(p, "event=", 6))
+                config |= v & 0xff;
+            else if (!std::strncmp(p, "umask=", 6))
+                config |= (v & 0xff) << 8;
+            else if (!std::strncmp(p, "edge=", 5))
+                config |= (v & 1ULL) << 18;
+            else if (!std::strncmp(p, "any=", 4))
+                config |= (v & 1ULL) << 21;
+            else if (!std::strncmp(p, "inv=", 4))
+                config |= (v & 1ULL) << 23;
+            else if (!std::strncmp(p, "cmask=", 6))
+                config |= (v & 0xff) << 24;
+            else
+                return false;                   // a term we don't place
+            char* comma = std::strchr(eq, ',');
+            if (!comma)
+                break;
+            p = comma + 1;
+        }
+        return true;
+    }
+
+    perf_counter_group  m_topdown;
+    perf_counter_group  m_slots;
+    perf_counter_group  m_generic;
+    unsigned            m_td_index[td_count];   // event index, max_events if not added
+    unsigned            m_sl_index[sl_count];
+    double              m_sl_scale[sl_count];   // sysfs scale of each level 1 event
+    unsigned            m_hw_index[hw_count];
+};
+
+template <typename Base>
+class TimerBaseTopdown : public Base {
+
+public:
+        typedef typename Base::duration duration;
+
+        TimerBaseTopdown() : m_ok(false) {
+        }
+
+        //      start the timer and snapshot the counters
+        void Start() {
+                m_metrics = topdown_metrics();
+                m_ok = perf_topdown_counters::Instance().Read(m_start);
+                Base::Start();
+        }
+
+        //      get the lap, and the metrics since Start()
+        unsigned long GetMs() {
+                unsigned long lap = Base::GetMs();
+                perf_topdown_counters& c = perf_topdown_counters::Instance();
+                perf_topdown_counters::snapshot now;
+                if (m_ok && Base::IsStarted() && c.Read(now))
+                        m_metrics = c.Metrics(m_start, now);
+                return lap;
+        }
+
+        //      top-down level 1, IPC and memory metrics of the last lap
+        topdown_metrics const& Topdown() const {
+                return m_metrics;
+        }
+
+        //      true if the CPU's own top-down metrics are counted
+        bool TopdownExact() const {
+                return perf_topdown_counters::Instance().Exact();
+        }
+private:
+        bool                                    m_ok;           // counters read at Start()
+        perf_topdown_counters::snapshot         m_start;
+        topdown_metrics                         m_metrics;      // from Start() to the last lap
+};
+
+# endif
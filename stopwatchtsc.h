@@ -0,0 +1,316 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_TSC_H
+#define PERF_STOPWATCH_TSC_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <vector>
+#include "stopwatch.h"
+#include "stopwatchclocksync.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*******************************************************************************
+ *  TimerBaseTsc -- cycle counter timer for basic_stopwatch
+ *
+ *  Reads the time stamp counter with rdtscp, which also returns the id of the
+ *  core the read happened on. If the thread migrated between Start() and the
+ *  read, the lap is corrected with the inter-core TSC offsets measured by
+ *  tsc_skew::Measure(), or flagged when no offsets are known. A lap that still
+ *  comes out negative is returned as 0 and flagged instead of wrapping around.
+ *
+ *      tsc_skew::Measure();                    // once, at startup, also calibrates
+ *      Stopwatchtsc sw("TheThing()");
+ *      TheThing();
+ *      sw.Stop();
+ *      if (sw.LapFlags() & tsc_lap_migrated)   // thread changed cores
+ *          ...
+ *
+ *  Converting ticks to nS needs the counter's rate, measured against
+ *  steady_clock by busy-waiting 20 mS. tsc_skew::Measure() does that, or
+ *  call tsc_clock::Calibrate() at startup; otherwise the first conversion
+ *  pays for it, in the middle of whatever it measures.
+ *
+ *  Off x86 the counter falls back to steady_clock in nS and the core id to
+ *  sched_getcpu() where available.
+ *
+ ********************************************************************************/
+
+//  raw cycle counter
+struct tsc_clock {
+    // read the counter
+    static unsigned long long now() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // read the counter and the id of the core it was read on
+    static unsigned long long now(unsigned& cpu) {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        unsigned aux;
+        unsigned long long t = __rdtscp(&aux);
+        cpu = aux & 0xfff;      // Linux puts the node number above bit 12
+        return t;
+#else
+#if defined(__linux__)
+        int c = sched_getcpu();
+        cpu = c < 0 ? 0 : (unsigned)c;
+#else
+        cpu = 0;
+#endif
+        return now();
+#endif
+    }
+
+    // length of one tick in nS, calibrated on first use unless Calibrate()
+    // ran before
+    static double ns_per_tick() {
+        double ns = Rate().load(std::memory_order_relaxed);
+        return ns > 0.0 ? ns : Calibrate();
+    }
+
+    // measure the tick length against steady_clock, busy-waits 20 mS
+    static double Calibrate() {
+        double ns = Measure();
+        Rate().store(ns, std::memory_order_relaxed);
+        return ns;
+    }
+
+private:
+    static std::atomic<double>& Rate() {
+        static std::atomic<double> rate(0.0);
+        return rate;
+    }
+
+    static double Measure() {
+#if !defined(_MSC_VER) && !defined(__x86_64__) && !defined(__i386__)
+        return 1.0;     // the steady_clock fallback counts nS
+#else
+        typedef std::chrono::steady_clock clock;
+        clock::time_point w0 = clock::now();
+        unsigned long long t0 = now();
+        clock::time_point w1;
+        do {
+            w1 = clock::now();
+        } while (w1 - w0 < std::chrono::milliseconds(20));
+        unsigned long long t1 = now();
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(w1 - w0).count();
+        return t1 > t0 ? ns / (double)(t1 - t0) : 1.0;
+#endif
+    }
+};
+
+//  lets basic_clocksync correlate cycle counter readings with UTC
+template <> struct clock_ticks<tsc_clock> {
+    static long long now()                  { return (long long)tsc_clock::now(); }
+    static double nominal_ns_per_tick()     { return tsc_clock::ns_per_tick(); }
+};
+
+//  inter-core counter offsets, relative to the first online core
+class tsc_skew {
+public:
+    // calibrate tsc_clock and measure the offsets of all cores, false if the
+    // platform can't pin threads. Call once at startup, before any timer
+    // reads the offsets
+    static bool Measure(int rounds = 1000);
+
+    // true if the offset of cpu is known
+    static bool Known(unsigned cpu) {
+        std::vector<long long> const& o = Offsets();
+        return cpu < o.size() && o[cpu] != LLONG_MAX;
+    }
+
+    // counter offset of cpu in ticks, 0 if unknown
+    static long long Offset(unsigned cpu) {
+        return Known(cpu) ? Offsets()[cpu] : 0;
+    }
+
+    // largest absolute offset measured, in ticks
+    static long long MaxSkew() {
+        long long m = 0;
+        std::vector<long long> const& o = Offsets();
+        for (size_t i = 0; i < o.size(); ++i) {
+            if (o[i] != LLONG_MAX && (o[i] < 0 ? -o[i] : o[i]) > m)
+                m = o[i] < 0 ? -o[i] : o[i];
+        }
+        return m;
+    }
+
+private:
+    static std::vector<long long>& Offsets() {
+        static std::vector<long long> offsets;
+        return offsets;
+    }
+
+#if defined(__linux__)
+    static bool Pin(unsigned cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    //  ping-pong between ref and cpu, the offset is the remote reading minus
+    //  the midpoint of the local round trip, taken from the fastest round
+    static long long MeasureOne(unsigned ref, unsigned cpu, int rounds) {
+        std::atomic<unsigned> seq(0);
+        std::atomic<unsigned long long> remote(0);
+        std::atomic<bool> pinned(true);
+
+        std::thread peer([&]() {
+            if (!Pin(cpu))
+                pinned = false;
+            for (int i = 0; i < rounds; ++i) {
+                unsigned want = 2 * (unsigned)i + 1;
+                while (seq.load(std::memory_order_acquire) != want)
+                    ;
+                remote.store(tsc_clock::now(), std::memory_order_relaxed);
+                seq.store(want + 1, std::memory_order_release);
+            }
+        });
+
+        long long best = LLONG_MAX;
+        unsigned long long best_rtt = ~0ULL;
+        if (!Pin(ref))
+            pinned = false;
+        for (int i = 0; i < rounds; ++i) {
+            unsigned want = 2 * (unsigned)i + 1;
+            unsigned long long t0 = tsc_clock::now();
+            seq.store(want, std::memory_order_release);
+            while (seq.load(std::memory_order_acquire) != want + 1)
+                ;
+            unsigned long long t1 = tsc_clock::now();
+            unsigned long long tr = remote.load(std::memory_order_relaxed);
+            if (t1 - t0 < best_rtt) {
+                best_rtt = t1 - t0;
+                best = (long long)(tr - (t0 + (t1 - t0) / 2));
+            }
+        }
+        peer.join();
+        return pinned ? best : LLONG_MAX;
+    }
+#endif
+};
+
+inline bool tsc_skew::Measure(int rounds) {
+    tsc_clock::Calibrate();
+#if defined(__linux__)
+    cpu_set_t saved;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) != 0)
+        return false;
+
+    unsigned ref = 0;
+    while (ref < CPU_SETSIZE && !CPU_ISSET(ref, &saved))
+        ++ref;
+    unsigned ncpu = 0;
+    for (unsigned c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &saved))
+            ncpu = c + 1;
+    }
+
+    std::vector<long long> offsets(ncpu, LLONG_MAX);
+    if (ref < ncpu)
+        offsets[ref] = 0;
+    for (unsigned c = ref + 1; c < ncpu; ++c) {
+        if (CPU_ISSET(c, &saved))
+            offsets[c] = MeasureOne(ref, c, rounds);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    Offsets().swap(offsets);
+    return true;
+#else
+    (void)rounds;
+    return false;
+#endif
+}
+
+//  flags describing the last lap of a TimerBaseTsc
+enum {
+    tsc_lap_ok        = 0,
+    tsc_lap_migrated  = 1,  // thread changed cores since Start()
+    tsc_lap_corrected = 2,  // migrated lap was corrected with tsc_skew offsets
+    tsc_lap_invalid   = 4   // lap came out negative and was clamped to 0
+};
+
+template <typename resolution>
+class TimerBaseTsc {
+
+public:
+        typedef resolution duration;    // unit of GetMs()
+        typedef tsc_clock clock;        // clock of GetStartTicks()
+
+        //      clears the timer
+        TimerBaseTsc() : m_start(0), m_cpu(0), m_flags(tsc_lap_ok) { }
+
+        //  clears the timer
+        void Clear() {
+                m_start = 0;
+        }
+
+        //      returns true if the timer is running
+        bool IsStarted() const {
+                return (m_start != 0);
+        }
+
+        //      start the timer
+        void Start() {
+                m_flags = tsc_lap_ok;
+                m_start = tsc_clock::now(m_cpu);
+        }
+
+        //      raw counter reading at Start(), 0 if not running
+        long long GetStartTicks() const {
+                return (long long)m_start;
+        }
+
+        //      flags describing the last lap, see tsc_lap_*
+        unsigned LapFlags() const {
+                return m_flags;
+        }
+
+        //      get the period since the timer was started
+        unsigned long GetMs() {
+                if (!IsStarted())
+                        return 0;
+                unsigned cpu;
+                long long ticks = (long long)(tsc_clock::now(cpu) - m_start);
+                m_flags = tsc_lap_ok;
+                if (cpu != m_cpu) {
+                        m_flags |= tsc_lap_migrated;
+                        if (tsc_skew::Known(cpu) && tsc_skew::Known(m_cpu)) {
+                                ticks -= tsc_skew::Offset(cpu) - tsc_skew::Offset(m_cpu);
+                                m_flags |= tsc_lap_corrected;
+                        }
+                }
+                if (ticks < 0) {
+                        m_flags |= tsc_lap_invalid;
+                        return 0;
+                }
+                std::chrono::duration<double, std::nano> ns((double)ticks * tsc_clock::ns_per_tick());
+                return (unsigned long)(std::chrono::duration_cast<resolution>(ns).count());
+        }
+private:
+        unsigned long long m_start;     // counter at Start(), 0 if not running
+        unsigned           m_cpu;       // core Start() ran on
+        unsigned           m_flags;     // tsc_lap_* flags of the last lap
+};
+
+typedef basic_stopwatch< TimerBaseTsc<std::chrono::microseconds> > Stopwatchtsc;
+
+# endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_USDT_H
+#define PERF_STOPWATCH_USDT_H
+
+/*******************************************************************************
+ *  USDT probes -- static tracepoints for eBPF and SystemTap tooling
+ *
+ *  basic_stopwatch fires USDT probes of provider "stopwatch" in Start(),
+ *  Show() and Stop(). A probe is a single nop in the code plus an ELF note in
+ *  .note.stapsdt, the same format <sys/sdt.h> writes, so no library or
+ *  header outside this tree is needed. Tracers patch the nop when they
+ *  attach; the probes cost nothing else when nobody listens.
+ *
+ *      probe               arguments
+ *      stopwatch:start     activity, event
+ *      stopwatch:show      activity, event, lap
+ *      stopwatch:stop      activity, event, lap
+ *
+ *  activity and event are C strings ("" when not printed), lap is in the
+ *  stopwatch's unit.
+ *
+ *      bpftrace -e 'usdt:./app:stopwatch:stop
+ *                   { @[str(arg0)] = hist(arg2); }'
+ *
+ *  Probes are emitted for ELF targets on x86-64 and AArch64 with GCC or
+ *  clang; elsewhere, or with STOPWATCH_NO_USDT defined, they compile to
+ *  nothing.
+ *
+ ********************************************************************************/
+
+#if !defined(STOPWATCH_NO_USDT) && defined(__ELF__) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__aarch64__))
+
+#if defined(__x86_64__)
+#define STOPWATCH_USDT_ARG "nor"
+#else
+#define STOPWATCH_USDT_ARG "r"
+#endif
+
+//  note layout: namesz, descsz, type 3, "stapsdt", then probe address, base
+//  address, semaphore (none), provider, name and argument spec "size@operand"
+#define STOPWATCH_USDT_NOTE(name, args) \
+    "990:   nop\n" \
+    "       .pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    "       .balign 4\n" \
+    "       .4byte 992f-991f, 994f-993f, 3\n" \
+    "991:   .asciz \"stapsdt\"\n" \
+    "992:   .balign 4\n" \
+    "993:   .8byte 990b\n" \
+    "       .8byte _.stapsdt.base\n" \
+    "       .8byte 0\n" \
+    "       .asciz \"stopwatch\"\n" \
+    "       .asciz \"" #name "\"\n" \
+    "       .asciz \"" args "\"\n" \
+    "994:   .balign 4\n" \
+    "       .popsection\n" \
+    "       .ifndef _.stapsdt.base\n" \
+    "       .pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    "       .weak _.stapsdt.base\n" \
+    "       .hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    "       .size _.stapsdt.base, 1\n" \
+    "       .popsection\n" \
+    "       .endif\n"
+
+#define STOPWATCH_USDT2(name, a1, a2) \
+    __asm__ __volatile__ (STOPWATCH_USDT_NOTE(name, "8@%0 8@%1") \
+        :: STOPWATCH_USDT_ARG ((unsigned long long)(a1)), \
+           STOPWATCH_USDT_ARG ((unsigned long long)(a2)))
+
+#define STOPWATCH_USDT3(name, a1, a2, a3) \
+    __asm__ __volatile__ (STOPWATCH_USDT_NOTE(name, "8@%0 8@%1 8@%2") \
+        :: STOPWATCH_USDT_ARG ((unsigned long long)(a1)), \
+           STOPWATCH_USDT_ARG ((unsigned long long)(a2)), \
+           STOPWATCH_USDT_ARG ((unsigned long long)(a3)))
+
+#else
+
+#define STOPWATCH_USDT2(name, a1, a2)       do { } while (0)
+#define STOPWATCH_USDT3(name, a1, a2, a3)   do { } while (0)
+
+#endif
+
+# endif
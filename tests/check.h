@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef PERF_STOPWATCH_TEST_CHECK_H
+#define PERF_STOPWATCH_TEST_CHECK_H
+
+#include <cmath>
+#include <iostream>
+
+//  minimal assertions for the tests: a failed check prints where and what,
+//  and the test's main() returns CheckExit()
+
+inline int& CheckFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+inline void Check(bool ok, char const* what, char const* file, int line) {
+    if (ok)
+        return;
+    std::cerr << file << ":" << line << ": failed: " << what << std::endl;
+    ++CheckFailures();
+}
+
+inline int CheckExit() {
+    if (CheckFailures())
+        std::cerr << CheckFailures() << " checks failed" << std::endl;
+    return CheckFailures() ? 1 : 0;
+}
+
+#define CHECK(expr)             Check((expr), #expr, __FILE__, __LINE__)
+#define CHECK_NEAR(a, b, tol)   Check(std::fabs((double)(a) - (double)(b)) <= (double)(tol), \
+                                      #a " near " #b, __FILE__, __LINE__)
+
+# endif
@@ -0,0 +1,126 @@
+//  bench_mann_whitney() against known p values, and CompareBaseline()
+//  verdicts on fixed samples
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "stopwatchbench.h"
+
+//  p values of the two-sided test, normal approximation with continuity and
+//  tie correction (R: wilcox.test(a, b, exact = FALSE, correct = TRUE))
+static void KnownAnswers() {
+    double const a[] = { 1, 2, 3 }, b[] = { 4, 5, 6 };
+    std::vector<double> va(a, a + 3), vb(b, b + 3);
+    CHECK_NEAR(bench_mann_whitney(va, vb), 0.0808555983700523, 1e-12);
+    CHECK_NEAR(bench_mann_whitney(vb, va), 0.0808555983700523, 1e-12);
+
+    double const c[] = { 1, 2, 3, 4, 5 }, d[] = { 6, 7, 8, 9, 10 };
+    std::vector<double> vc(c, c + 5), vd(d, d + 5);
+    CHECK_NEAR(bench_mann_whitney(vc, vd), 0.012185780355344818, 1e-12);
+
+    //  ties: ranks 1.5 1.5 3.5 3.5 6 6 6 8.5 8.5, U = 2.5
+    double const e[] = { 1, 1, 2, 3 }, f[] = { 2, 3, 3, 4, 4 };
+    std::vector<double> ve(e, e + 4), vf(f, f + 5);
+    CHECK_NEAR(bench_mann_whitney(ve, vf), 0.07723605293697139, 1e-12);
+
+    //  interleaved, order of the input doesn't matter
+    double const g[] = { 7, 1, 5, 3 }, h[] = { 8, 2, 6, 4 };
+    std::vector<double> vg(g, g + 4), vh(h, h + 4);
+    CHECK_NEAR(bench_mann_whitney(vg, vh), 0.6650055421020291, 1e-12);
+
+    //  nothing to tell apart
+    std::vector<double> same(5, 3.0), none;
+    CHECK(bench_mann_whitney(same, same) == 1.0);
+    CHECK(bench_mann_whitney(va, none) == 1.0);
+    CHECK(bench_mann_whitney(none, va) == 1.0);
+    CHECK(bench_mann_whitney(va, va) == 1.0);
+}
+
+static bench_result Result(char const* name, double center, double step) {
+    bench_result r;
+    r.name = name;
+    r.iterations = 1000;
+    for (int i = 0; i < 27; ++i)
+        r.samples.push_back(center + step * (double)(i % 9 - 4));
+    return r;
+}
+
+//  sets the results a Run() would have left
+struct fixed_bench : Benchmark {
+    explicit fixed_bench(std::ostream& log) : Benchmark(log) { }
+    void ResultsSet(std::vector<bench_result> const& r) { m_results = r; }
+};
+
+static void Compare() {
+    std::vector<bench_result> baseline, now;
+    baseline.push_back(Result("slower", 100.0, 0.5));
+    baseline.push_back(Result("faster", 100.0, 0.5));
+    baseline.push_back(Result("noisy", 100.0, 10.0));
+    baseline.push_back(Result("small", 100.0, 0.1));
+    baseline.push_back(Result("gone", 100.0, 0.5));
+    now.push_back(Result("slower", 110.0, 0.5));    // +10%, p tiny
+    now.push_back(Result("faster", 90.0, 0.5));     // -10%
+    now.push_back(Result("noisy", 103.0, 10.0));    // +3% but p large
+    now.push_back(Result("small", 101.0, 0.1));     // p tiny but +1% < threshold
+    now.push_back(Result("new", 100.0, 0.5));
+
+    std::ostringstream log;
+    fixed_bench bench(log);
+    bench.ResultsSet(now);
+    CHECK(bench.CompareBaseline(baseline, 0.01, 0.02) == 1);
+
+    std::istringstream lines(log.str());
+    std::string line;
+    std::vector<std::string> out;
+    while (std::getline(lines, line))
+        out.push_back(line);
+    CHECK(out.size() == 5);
+    if (out.size() != 5)
+        return;
+    CHECK(out[0].find("slower: 100ns -> 110ns +10% p=") == 0);
+    CHECK(out[0].find(" REGRESSION") != std::string::npos);
+    CHECK(out[1].find("faster: 100ns -> 90ns -10% p=") == 0);
+    CHECK(out[1].find(" improved") != std::string::npos);
+    CHECK(out[2].find(" same") != std::string::npos);
+    CHECK(out[3].find(" same") != std::string::npos);
+    CHECK(out[4] == "new: not in baseline");
+
+    //  a stricter threshold makes the small shift a regression too
+    CHECK(bench.CompareBaseline(baseline, 0.01, 0.005) == 2);
+}
+
+static void BaselineRoundTrip() {
+    std::vector<bench_result> results;
+    results.push_back(Result("plain", 12.25, 0.125));
+    results.push_back(Result("with \"quotes\" and \\", 1e-3, 1e-5));
+
+    std::ostringstream log;
+    fixed_bench bench(log);
+    bench.ResultsSet(results);
+    std::string const path = "test_bench_baseline.json";
+    CHECK(bench.SaveBaseline(path));
+    std::vector<bench_result> loaded;
+    CHECK(Benchmark::LoadBaseline(path, loaded));
+    std::remove(path.c_str());
+
+    CHECK(loaded.size() == results.size());
+    for (size_t i = 0; i < loaded.size() && i < results.size(); ++i) {
+        CHECK(loaded[i].name == results[i].name);
+        CHECK(loaded[i].iterations == results[i].iterations);
+        CHECK(loaded[i].samples == results[i].samples);
+    }
+
+    //  the same results compare as unchanged
+    CHECK(bench.CompareBaseline(loaded) == 0);
+    CHECK(log.str().find("REGRESSION") == std::string::npos);
+    CHECK(!Benchmark::LoadBaseline("no/such/baseline.json", loaded));
+}
+
+int main() {
+    KnownAnswers();
+    Compare();
+    BaselineRoundTrip();
+    return CheckExit();
+}
@@ -0,0 +1,147 @@
+//  stopwatch_changepoint: MeanRunLength() known answers, and the level and
+//  tail tests on fixed lap sequences
+
+#include <cmath>
+#include <vector>
+#include "check.h"
+#include "stopwatchchange.h"
+
+static std::vector<stopwatch_change>& Changes() {
+    static std::vector<stopwatch_change> changes;
+    return changes;
+}
+
+//  Siegmund's approximation with b = 12 + 1.166 and slack 0.5: no shift
+//  gives two sides of (e^b - b - 1) / 0.5 each; a shift of the slack leaves
+//  one side without drift, b^2
+static void MeanRunLength() {
+    CHECK_NEAR(stopwatch_changepoint::MeanRunLength(0.0), 522287.18444788706, 1e-6);
+    CHECK_NEAR(stopwatch_changepoint::MeanRunLength(0.5), 173.34355577970578, 1e-9);
+    CHECK_NEAR(stopwatch_changepoint::MeanRunLength(1.0), 24.332003829207004, 1e-9);
+    CHECK_NEAR(stopwatch_changepoint::MeanRunLength(-1.0), 24.332003829207004, 1e-9);
+    //  the doc's example, 20% at a log deviation of 0.3
+    CHECK_NEAR(stopwatch_changepoint::MeanRunLength(std::log(1.2) / 0.3), 81.65234201706714, 1e-9);
+    CHECK(stopwatch_changepoint::MeanRunLength(0.0, 6.0) < stopwatch_changepoint::MeanRunLength(0.0));
+}
+
+//  constant laps have the deviation floor of 0.01, so 10% is 9.5 deviations
+//  and the level test alarms on the second slower lap
+static void Level() {
+    stopwatch_changepoint d("level");
+    size_t laps = 0;
+    for (size_t i = 0; i < stopwatch_changepoint::baseline_laps + 5000; ++i, ++laps)
+        CHECK(!d.Record(1000));
+    CHECK(Changes().empty());
+
+    CHECK(!d.Record(1100));
+    CHECK(d.Record(1100));
+    laps += 2;
+    CHECK(Changes().size() == 1);
+    if (Changes().size() == 1) {
+        stopwatch_change const& c = Changes()[0];
+        CHECK(c.kind == stopwatch_change::mean_up);
+        CHECK(c.activity == d.Activity());
+        CHECK(c.lap == laps);
+        CHECK_NEAR(c.before, 1000.0, 1e-6);
+        CHECK_NEAR(c.after, 1100.0, 1e-6);
+    }
+
+    //  a new baseline at the new level: nothing while it is taken, then the
+    //  way back down is a change
+    for (size_t i = 0; i < stopwatch_changepoint::baseline_laps; ++i)
+        CHECK(!d.Record(i % 2 ? 1100 : 1000000));
+    Changes().clear();
+    stopwatch_changepoint e("down");
+    for (size_t i = 0; i < stopwatch_changepoint::baseline_laps; ++i)
+        e.Record(1100);
+    CHECK(!e.Record(1000));
+    CHECK(e.Record(1000));
+    CHECK(Changes().size() == 1 && Changes()[0].kind == stopwatch_change::mean_down);
+    Changes().clear();
+}
+
+//  a baseline spread over 1000..1099 (95th percentile 1094), then every
+//  fifth lap above it and the others near the mean: the level stays, the
+//  tail test alarms after 125 laps
+static void Tail() {
+    stopwatch_changepoint d("tail");
+    for (size_t i = 0; i < stopwatch_changepoint::baseline_laps; ++i)
+        d.Record(1000 + (i * 37) % 100);
+    size_t k = 1;
+    while (k < 1000 && !d.Record(k % 5 ? 1040 : 1099))
+        ++k;
+    CHECK(k == 125);
+    CHECK(Changes().size() == 1);
+    if (Changes().size() == 1) {
+        stopwatch_change const& c = Changes()[0];
+        CHECK(c.kind == stopwatch_change::tail_up);
+        CHECK(c.lap == stopwatch_changepoint::baseline_laps + 125);
+        CHECK(c.threshold_ns == 1094.0);
+        CHECK_NEAR(c.before, 0.05, 1e-12);
+        CHECK(c.after > 0.15 && c.after < 0.25);
+    }
+    Changes().clear();
+}
+
+//  log normal laps, deviation 0.3, from a fixed generator
+class lognormal_laps {
+public:
+    explicit lognormal_laps(unsigned long long seed) : m_state(seed | 1) { }
+
+    unsigned long long operator()(double level) {
+        double z = std::sqrt(-2.0 * std::log(Uniform())) * std::cos(6.283185307179586 * Uniform());
+        return (unsigned long long)(level * std::exp(0.3 * z));
+    }
+
+private:
+    double Uniform() {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 7;
+        m_state ^= m_state << 17;
+        return ((double)(m_state >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    unsigned long long m_state;
+};
+
+//  stationary laps: about one false alarm of the level test in 450000 laps
+//  and of the tail test in 2 million, 5 expected here. How far the
+//  baseline's estimate is off spreads that, 17 was the most in 40 runs
+static void FalseAlarms() {
+    lognormal_laps lap(88172645463325252ULL);
+    stopwatch_changepoint d("stationary");
+    for (size_t i = 0; i < 2000000; ++i)
+        d.Record(lap(100000.0));
+    CHECK(Changes().size() <= 30);
+    Changes().clear();
+}
+
+//  a 20% step is found in a few times MeanRunLength(), about 80 laps
+static void Step() {
+    lognormal_laps lap(0x9e3779b97f4a7c15ULL);
+    stopwatch_changepoint d("step");
+    for (size_t i = 0; i < stopwatch_changepoint::baseline_laps; ++i)
+        d.Record(lap(100000.0));
+    size_t k = 1;
+    while (k < 1000 && !d.Record(lap(120000.0)))
+        ++k;
+    CHECK(k < 1000);
+    CHECK(Changes().size() == 1);
+    if (Changes().size() == 1) {
+        stopwatch_change const& c = Changes()[0];
+        CHECK(c.kind == stopwatch_change::mean_up);
+        CHECK(c.before > 95000.0 && c.before < 105000.0);
+        CHECK(c.after > c.before * 1.1);
+    }
+    Changes().clear();
+}
+
+int main() {
+    stopwatch_changepoint::SetHandler([](stopwatch_change const& c) { Changes().push_back(c); });
+    MeanRunLength();
+    Level();
+    Tail();
+    FalseAlarms();
+    Step();
+    return CheckExit();
+}
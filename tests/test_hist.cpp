@@ -0,0 +1,172 @@
+//  basic_histogram: Serialize()/Deserialize() and Print()/Parse(), known
+//  answers and round trips
+
+#include <sstream>
+#include <string>
+#include "check.h"
+#include "stopwatchhist.h"
+
+template <unsigned SubBits>
+static bool Same(basic_histogram<SubBits> const& a, basic_histogram<SubBits> const& b) {
+    if (a.Count() != b.Count() || a.Min() != b.Min() || a.Max() != b.Max() || a.Sum() != b.Sum())
+        return false;
+    for (size_t i = 0; i < basic_histogram<SubBits>::bucket_count; ++i) {
+        if (a.BucketGet(i) != b.BucketGet(i))
+            return false;
+    }
+    return true;
+}
+
+//  1 and 2 get a bucket each, 100 = 0b1100100 is in the 2^6 octave, shift 1,
+//  bucket (1 << 5) + (100 >> 1) = 82
+static void KnownAnswers() {
+    Histogram h;
+    h.Record(1);
+    h.Record(2);
+    h.Record(100);
+    CHECK(Histogram::BucketIndex(100) == 82);
+    CHECK(Histogram::BucketLow(82) == 100 && Histogram::BucketHigh(82) == 101);
+
+    std::ostringstream text;
+    h.Print(text);
+    CHECK(text.str() == "histogram 1 5 3 1 100 103 1:1 2:1 82:1\n");
+
+    std::string bin;
+    h.Serialize(bin);
+    static char const expected[] = "SWH\x01\x05"        // magic, version, SubBits
+                                   "\x03\x01\x64\x67"   // count 3, min 1, max 100, sum 103
+                                   "\x03"               // 3 nonempty buckets
+                                   "\x01\x01"           // bucket 1, count 1
+                                   "\x01\x01"           // +1 = bucket 2, count 1
+                                   "\x50\x01";          // +80 = bucket 82, count 1
+    CHECK(bin == std::string(expected, sizeof(expected) - 1));
+
+    //  varints are 7 bits per byte, low first
+    Histogram big;
+    big.Record(300);
+    bin.clear();
+    big.Serialize(bin);
+    CHECK(bin.compare(5, 5, std::string("\x01\xac\x02\xac\x02", 5)) == 0);
+}
+
+static void RoundTrip() {
+    Histogram h;
+    unsigned long long v = 1;
+    for (int i = 0; i < 2000; ++i) {
+        h.Record(v % 1000000007ULL);
+        v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    h.Record(0);
+    h.Record(1ULL << 50);
+
+    std::string bin;
+    h.Serialize(bin);
+    size_t pos = 0;
+    Histogram b;
+    b.Record(7);                    // replaced, not added to
+    CHECK(b.Deserialize(bin, pos));
+    CHECK(pos == bin.size());
+    CHECK(Same(h, b));
+
+    std::stringstream text;
+    h.Print(text);
+    Histogram t;
+    CHECK(t.Parse(text));
+    CHECK(Same(h, t));
+
+    //  two in a row, each read advances past its own
+    Histogram small;
+    small.Record(42);
+    std::string both;
+    h.Serialize(both);
+    small.Serialize(both);
+    pos = 0;
+    Histogram first, second;
+    CHECK(first.Deserialize(both, pos) && second.Deserialize(both, pos));
+    CHECK(pos == both.size());
+    CHECK(Same(h, first) && Same(small, second));
+
+    std::stringstream lines;
+    h.Print(lines);
+    small.Print(lines);
+    CHECK(first.Parse(lines) && second.Parse(lines));
+    CHECK(Same(h, first) && Same(small, second));
+
+    //  empty
+    Histogram empty, e;
+    bin.clear();
+    empty.Serialize(bin);
+    pos = 0;
+    CHECK(e.Deserialize(bin, pos) && Same(empty, e));
+    CHECK(e.Min() == 0 && e.Count() == 0);
+    std::stringstream etext;
+    empty.Print(etext);
+    CHECK(etext.str() == "histogram 1 5 0 0 0 0\n");
+    CHECK(e.Parse(etext) && Same(empty, e));
+
+    //  a merged histogram serializes like the one of all values
+    Histogram m;
+    m.Merge(h).Merge(small);
+    Histogram all = h;
+    all.Record(42);
+    std::string mb, ab;
+    m.Serialize(mb);
+    all.Serialize(ab);
+    CHECK(mb == ab);
+}
+
+static void Rejects() {
+    Histogram h;
+    h.Record(100);
+    h.Record(5000);
+    std::string bin;
+    h.Serialize(bin);
+    size_t pos;
+
+    //  every truncation fails and leaves pos alone
+    for (size_t n = 0; n < bin.size(); ++n) {
+        Histogram t;
+        pos = 0;
+        CHECK(!t.Deserialize(bin.substr(0, n), pos) && pos == 0);
+    }
+
+    std::string bad = bin;
+    bad[0] = 'X';
+    pos = 0;
+    CHECK(!Histogram().Deserialize(bad, pos));
+    bad = bin;
+    bad[3] = 2;                     // version
+    pos = 0;
+    CHECK(!Histogram().Deserialize(bad, pos));
+
+    //  SubBits must match
+    basic_histogram<4> other;
+    pos = 0;
+    CHECK(!other.Deserialize(bin, pos));
+    std::stringstream text;
+    h.Print(text);
+    CHECK(!other.Parse(text));
+
+    //  a failed read keeps the histogram
+    Histogram kept;
+    kept.Record(9);
+    std::istringstream junk("histogram 1 5 1 9 9 9 99999:1\n");
+    CHECK(!kept.Parse(junk));
+    CHECK(kept.Count() == 1 && kept.BucketGet(Histogram::BucketIndex(9)) == 1);
+
+    std::istringstream tag("histogrom 1 5 0 0 0 0\n");
+    CHECK(!kept.Parse(tag));
+    std::istringstream colon("histogram 1 5 1 9 9 9 9=1\n");
+    CHECK(!kept.Parse(colon));
+    std::istringstream trailing("histogram 1 5 1 9 9 9 9:1 x\n");
+    CHECK(!kept.Parse(trailing));
+    std::istringstream none("");
+    CHECK(!kept.Parse(none));
+}
+
+int main() {
+    KnownAnswers();
+    RoundTrip();
+    Rejects();
+    return CheckExit();
+}